@@ -0,0 +1,57 @@
+#include "clIncludes.h"
+
+#define TILE_W (GW + 2 * D)
+#define TILE_H (GH + 2 * D)
+
+__constant const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+// mean + stdDev as a separable box filter: every work-group loads its tile of the gray image plus the window
+// halo into local memory once, sums WINDOW pixels along every tile row, then WINDOW of these row sums down
+// every column, so a pixel costs O(WINDOW) instead of O(WINDOW^2) additions
+__kernel void boxFilter(__read_only image2d_t gray, __write_only image2d_t means, __write_only image2d_t stdDev) {
+	const int cx = get_global_id(0);
+	const int cy = get_global_id(1);
+	const int gx = get_local_id(0);
+	const int gy = get_local_id(1);
+	const int tileX = get_group_id(0) * GW - D;
+	const int tileY = get_group_id(1) * GH - D;
+	__local float tile[TILE_H][TILE_W];
+	__local float2 rowSums[TILE_H][GW];
+	for (int ty = gy; ty < TILE_H; ty += GH) {
+		for (int tx = gx; tx < TILE_W; tx += GW) {
+			tile[ty][tx] = read_imagef(gray, sampler, (int2)(tileX + tx, tileY + ty)).x;
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// sums of the samples shifted by a value of the tile, which keeps the sums of squares small enough for
+	// float precision in flat areas
+	const float shift = tile[TILE_H / 2][TILE_W / 2];
+
+	// horizontal pass over the rows of the work-group and of the halo above and below it
+	for (int ty = gy; ty < TILE_H; ty += GH) {
+		float2 sums = (float2)(0.f, 0.f);
+		for (int col = gx; col < gx + WINDOW; ++col) {
+			const float value = tile[ty][col] - shift;
+			sums += (float2)(value, value * value);
+		}
+		rowSums[ty][gx] = sums;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// the global range is padded to whole work-groups
+	if (cx >= get_image_width(means) || cy >= get_image_height(means)) {
+		return;
+	}
+
+	// vertical pass
+	float2 sums = (float2)(0.f, 0.f);
+	for (int row = gy; row < gy + WINDOW; ++row) {
+		sums += rowSums[row][gx];
+	}
+	const int2 coord = (int2)(cx, cy);
+	write_imagef(means, coord, shift + sums.x / (float)(WINDOW * WINDOW));
+	write_imagef(stdDev, coord, sqrt(max(sums.y - sums.x * sums.x / (float)(WINDOW * WINDOW), 0.f)));
+}
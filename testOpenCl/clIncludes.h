@@ -1,8 +1,78 @@
+// Default algorithm constants and helpers shared by the kernels. The host passes the values of
+// `ClUtils::DisparityParams` as -D build options, which take precedence over these defaults.
+#ifndef WINDOW
 #define WINDOW 9
+#endif
+#ifndef D
 #define D 4
+#endif
+#ifndef MAX_DISP
 #define MAX_DISP 65
+#endif
+#ifndef CROSS_TH
 #define CROSS_TH 8
+#endif
+#ifndef MAX_OFFSET
 #define MAX_OFFSET 50
+#endif
 
+#ifndef GW
 #define GW 15
-#define GH 8
\ No newline at end of file
+#endif
+#ifndef GH
+#define GH 8
+#endif
+
+// the input image is this many times larger than the gray image the algorithm works on, can be non-integer
+#ifndef DOWNSCALE
+#define DOWNSCALE 4.f
+#endif
+// the most input pixels a gray pixel covers in one direction
+#define FOOTPRINT ((int)DOWNSCALE + 2)
+
+// TEMPORAL_RANGE enables the temporal search of disparity.cl, it has no default
+#ifndef TEMPORAL_MIN_CONF
+#define TEMPORAL_MIN_CONF 0.6f
+#endif
+#ifndef TEMPORAL_MAX_CHANGE
+#define TEMPORAL_MAX_CHANGE 8.f
+#endif
+
+
+// the gray level the correlation kernels subtract from the samples to keep their sums of products small
+#define MID_GRAY 128.f
+
+// the packed statistics image of a window: its mean, and the reciprocal of the root of its summed squared
+// deviations, zero for a flat window, which then correlates with nothing
+inline float4 packedStats(float mean, float stdDev) {
+	return (float4)(mean, stdDev > 0.f ? 1.f / stdDev : 0.f, 0.f, 0.f);
+}
+
+
+// the length of the part of pixel i inside [lo, hi)
+inline float coverage(int i, float lo, float hi) {
+	return clamp(min((float)(i + 1), hi) - max((float)i, lo), 0.f, 1.f);
+}
+
+inline float rgbaToGray(uint4 rgba) {
+	const float4 rgb2gray = { 0.2126f, 0.7152f, 0.0722f, 0.f };
+	return dot(rgb2gray, convert_float4(rgba));
+}
+
+// area average downscale: the gray value of a pixel of the downscaled image is the mean of the input pixels
+// under its footprint, weighted by how much of them it covers. The input gray values are staged in local memory,
+// `src` holds the rectangle of the input starting at (srcX, srcY), `pitch` floats per row.
+inline float areaGray(__local const float* src, int pitch, int srcX, int srcY, int2 coord) {
+	const float x0 = coord.x * DOWNSCALE;
+	const float y0 = coord.y * DOWNSCALE;
+	const int ix = (int)x0;
+	const int iy = (int)y0;
+	float sum = 0.f;
+	for (int j = 0; j < FOOTPRINT; ++j) {
+		const float wy = coverage(iy + j, y0, y0 + DOWNSCALE);
+		for (int i = 0; i < FOOTPRINT; ++i) {
+			sum += wy * coverage(ix + i, x0, x0 + DOWNSCALE) * src[(iy + j - srcY) * pitch + ix + i - srcX];
+		}
+	}
+	return sum / (DOWNSCALE * DOWNSCALE);
+}
@@ -0,0 +1,108 @@
+#include "clIncludes.h"
+
+// ZNCC from a cost volume: for every disparity slice the products of the left and the shifted right image are
+// box filtered with sliding sums, along the rows by costRows and down the columns by costColumns, so a pixel
+// costs the same for any window size. With the window means the sum of the products gives the covariance:
+//   sum((L - meanL)(R - meanR)) = sum(L R) - WINDOW^2 meanL meanR
+// The samples are stored relative to mid gray in fixed point with COST_BITS fraction bits, so the sliding sums
+// are exact integers and do not drift along the rows. The volume holds the slices [firstDisp, firstDisp + slices)
+// of the disparity range, selectDisparity keeps the best score over the slices of successive volumes.
+#define COST_BITS 4
+
+__constant const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+
+inline float sample(__read_only image2d_t in, int col, int row) {
+	return read_imagef(in, sampler, (int2)(col, row)).x;
+}
+
+inline int fixedSample(__read_only image2d_t in, int col, int row) {
+	return convert_int_rte((sample(in, col, row) - MID_GRAY) * (float)(1 << COST_BITS));
+}
+
+// the product of the left pixel and the right pixel d to the left, clamped to the edges like disparity.cl
+inline int product(__read_only image2d_t left, __read_only image2d_t right, int col, int row, int d) {
+	return fixedSample(left, col, row) * fixedSample(right, col - d, row);
+}
+
+
+// every work-item slides along one row of one slice
+__kernel void costRows(__read_only image2d_t left, __read_only image2d_t right, __global int* volume, int invertD, int firstDisp) {
+	const int y = get_global_id(0);
+	const int slice = get_global_id(1);
+	const int width = get_image_width(left);
+	const int height = get_image_height(left);
+	const int d = invertD ? -(firstDisp + slice) : firstDisp + slice;
+	__global int* row = volume + ((size_t)slice * height + y) * width;
+	int sum = 0;
+	for (int col = -D; col <= D; ++col) {
+		sum += product(left, right, col, y, d);
+	}
+	for (int x = 0; x < width; ++x) {
+		row[x] = sum;
+		sum += product(left, right, x + D + 1, y, d) - product(left, right, x - D, y, d);
+	}
+}
+
+
+// every work-item slides down one column of one slice, replacing the row sums by the ZNCC scores,
+// the stats images hold the window means and the reciprocal standard deviations, zero for flat windows
+__kernel void costColumns(
+	__global int* volume, __read_only image2d_t leftStats, __read_only image2d_t rightStats, int invertD, int firstDisp)
+{
+	const int x = get_global_id(0);
+	const int slice = get_global_id(1);
+	const int width = get_image_width(leftStats);
+	const int height = get_image_height(leftStats);
+	const int d = invertD ? -(firstDisp + slice) : firstDisp + slice;
+	__global int* column = volume + (size_t)slice * height * width + x;
+
+	// the row sums of the window rows y - D to y + D, row r at (r + D) % WINDOW, because the scores overwrite them
+	int window[WINDOW];
+	long sum = 0;
+	for (int i = 0; i < WINDOW; ++i) {
+		window[i] = column[(size_t)clamp(i - D, 0, height - 1) * width];
+		sum += window[i];
+	}
+	for (int y = 0; y < height; ++y) {
+		const float2 statsL = read_imagef(leftStats, sampler, (int2)(x, y)).xy;
+		const float2 statsR = read_imagef(rightStats, sampler, (int2)(x - d, y)).xy;
+		const float covariance = (float)sum / (float)(1 << 2 * COST_BITS) - (float)(WINDOW * WINDOW) * (statsL.x - MID_GRAY) * (statsR.x - MID_GRAY);
+		// a flat window scores 0 instead of dividing by a zero deviation
+		const float zncc = covariance * statsL.y * statsR.y;
+
+		// row y + D + 1 replaces row y - D, it is read before the score of row y is written
+		const int slot = y % WINDOW;
+		const int next = column[(size_t)min(y + D + 1, height - 1) * width];
+		sum += next - window[slot];
+		window[slot] = next;
+		column[(size_t)y * width] = as_int(zncc);
+	}
+}
+
+
+// keeps the best score of every pixel over the slices of the volume, the last volume writes the disparity map
+__kernel void selectDisparity(
+	__global const int* volume, __global float* bestZncc, __global int* bestDisp, __write_only image2d_t output,
+	int firstDisp, int slices, int last)
+{
+	const int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	const int width = get_image_width(output);
+	const size_t sliceSize = (size_t)width * get_image_height(output);
+	const size_t i = (size_t)coord.y * width + coord.x;
+	float best = firstDisp == 0 ? 0.f : bestZncc[i];
+	int disp = firstDisp == 0 ? 0 : bestDisp[i];
+	for (int slice = 0; slice < slices; ++slice) {
+		const float zncc = as_float(volume[slice * sliceSize + i]);
+		if (zncc > best) {
+			best = zncc;
+			disp = firstDisp + slice;
+		}
+	}
+	if (last) {
+		write_imageui(output, coord, convert_uchar((float)disp / MAX_DISP * 255.f));
+	} else {
+		bestZncc[i] = best;
+		bestDisp[i] = disp;
+	}
+}
@@ -2,63 +2,258 @@
 
 __constant const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
 
+#ifdef HALF_MATH
+#pragma OPENCL EXTENSION cl_khr_fp16 : enable
+// the tiles hold half samples and the products are computed in half, the correlation sums stay float. Both
+// images are cached relative to mid gray, which keeps the half products small.
+typedef half sample_t;
+#define RIGHT_SHIFT MID_GRAY
+#else
+typedef float sample_t;
+#define RIGHT_SHIFT 0.f
+#endif
+#define rightSample(value) ((sample_t)((value) - RIGHT_SHIFT))
+
+#ifdef DISP_CHUNK
+// the right image strip the disparities [chunk, chunk + DISP_CHUNK) of a work-group read
+#define STRIP_W (GW + 2 * D + DISP_CHUNK - 1)
+#define STRIP_H (GH + 2 * D)
+#define STRIP_PITCH (STRIP_W + 1 - STRIP_W % 2)
+#define STATS_W (GW + DISP_CHUNK - 1)
+#endif
+
 
 inline float sample(__read_only image2d_t in, int col, int row) {
 	return read_imagef(in, sampler, (int2)(col, row)).x;
 }
 
 
+#ifdef DISP_VEC
+// DISP_VEC (4, 8 or 16) consecutive disparities are scored at once in the lanes of a vector, every left
+// sample is multiplied with the right samples of all lanes
+#define CAT_(a, b) a##b
+#define CAT(a, b) CAT_(a, b)
+#define floatV CAT(float, DISP_VEC)
+#define intV CAT(int, DISP_VEC)
+#define vloadV CAT(vload, DISP_VEC)
+#define vstoreV CAT(vstore, DISP_VEC)
+#define toFloatV CAT(convert_float, DISP_VEC)
+#if DISP_VEC == 4
+#define LANES (int4)(0, 1, 2, 3)
+#elif DISP_VEC == 8
+#define LANES (int8)(0, 1, 2, 3, 4, 5, 6, 7)
+#else
+#define LANES (int16)(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+#endif
+
+// the lanes of the disparities [disp0, disp0 + DISP_VEC) are ordered so that they read ascending right image
+// columns, which makes the right samples of all lanes one vload
+inline intV laneDisparities(int disp0, int invertD) {
+	return invertD ? disp0 + LANES : disp0 + (DISP_VEC - 1) - LANES;
+}
+
+// the right image column lane 0 reads under the first column of the window of pixel cx
+inline int laneColumn(int cx, int disp0, int invertD) {
+	return cx - D + (invertD ? disp0 : -(disp0 + DISP_VEC - 1));
+}
+
+// keeps the best score of every lane, from the disparities of the search range only
+inline void keepBest(floatV zncc, intV disps, int firstDisp, int lastDisp, floatV* best, intV* bestDisps) {
+	const intV better = zncc > *best && disps >= firstDisp && disps <= lastDisp;
+	*best = select(*best, zncc, better);
+	*bestDisps = select(*bestDisps, disps, better);
+}
+#endif
+
+
 __kernel void disparity(
 	__write_only image2d_t output, __read_only image2d_t left, __read_only image2d_t right,
-	__read_only image2d_t leftMeans, __read_only image2d_t rightMeans,
-	__read_only image2d_t leftStd, __read_only image2d_t rightStd, int invertD)
+	__read_only image2d_t leftStats, __read_only image2d_t rightStats, int invertD
+#ifdef TEMPORAL_RANGE
+	// the previous frame of the same direction, and the confidence output for the next one
+	, __read_only image2d_t prevDisp, __read_only image2d_t prevConfidence, __read_only image2d_t prevMeans,
+	__write_only image2d_t confidence
+#endif
+	)
 {
 	const int cx = get_global_id(0);
 	const int cy = get_global_id(1);
 	const int gx = get_local_id(0);
 	const int gy = get_local_id(1);
-	const float meanL = sample(leftMeans, cx, cy);
+	// the window mean and the reciprocal standard deviation
+	const float2 statsL = read_imagef(leftStats, sampler, (int2)(cx, cy)).xy;
+	const float meanL = statsL.x;
 
-	// cache left samples
+	// cache left samples relative to mid gray, which keeps the sums of the products small. The covariance is then
+	//   sum((L - meanL)(R - meanR)) = sum((L - MID_GRAY)(R - RIGHT_SHIFT)) - WINDOW^2 (meanL - MID_GRAY)(meanR - RIGHT_SHIFT)
+	// so the hot loop multiplies raw right samples and the normalization is applied once per candidate.
+	const float correctionL = (float)(WINDOW * WINDOW) * (meanL - MID_GRAY);
 	const int bw = GW + 2 * D;
 	const int bh = GH + 2 * D;
-	__local float leftBuffer[bw*bh];
+	__local sample_t leftBuffer[bw*bh];
 	const int xiter = (bw - gx) / GW + 1;
 	const int yiter = (bh - gy) / GH + 1;
 	for (int j = 0; j < yiter; ++j) {
 		for (int i = 0; i < xiter; ++i) {
 			const int globalx = cx - D + i*GW;
 			const int globaly = cy - D + j*GH;
-			const float smpl = sample(left, globalx, globaly);
+			const float smpl = sample(left, globalx, globaly) - MID_GRAY;
 
 			const int bufferx = gx + i*GW;
 			const int buffery = gy + j*GH;
 			const int bufferi = buffery * bw + bufferx;
-			leftBuffer[bufferi] = smpl;
+			leftBuffer[bufferi] = (sample_t)smpl;
 		}
 	}
 	
 	barrier(CLK_LOCAL_MEM_FENCE);
 
+	int firstDisp = 0;
+	int lastDisp = MAX_DISP - 1;
+#ifdef TEMPORAL_RANGE
+	// search around the previous disparity where it was confident and the image barely changed
+	const float prevConf = sample(prevConfidence, cx, cy);
+	const float change = fabs(meanL - sample(prevMeans, cx, cy));
+	if (prevConf >= TEMPORAL_MIN_CONF && change <= TEMPORAL_MAX_CHANGE) {
+		const int prevD = convert_int_rte(read_imageui(prevDisp, sampler, (int2)(cx, cy)).x * MAX_DISP / 255.f);
+		firstDisp = max(prevD - TEMPORAL_RANGE, 0);
+		lastDisp = min(prevD + TEMPORAL_RANGE, MAX_DISP - 1);
+	}
+#endif
+
 	float bestZncc = 0.f;
 	int bestDisp = 0;
-	for (int disp = 0; disp < MAX_DISP; ++disp) {
-		const float d = invertD ? -disp : disp;
-		const float meanR = sample(rightMeans, cx - d, cy);
+#ifdef DISP_VEC
+	floatV bestV = 0.f;
+	intV bestDispV = 0;
+#endif
+#ifdef DISP_CHUNK
+	// cache the right image strip every disparity of a chunk reads, with the right window statistics of the
+	// work-group rows. The odd row pitch puts the rows of the strip in different local memory banks.
+	__local sample_t rightStrip[STRIP_H * STRIP_PITCH];
+	__local float2 rightStatsRows[GH * STATS_W];
+	const int groupX = cx - gx;
+	const int groupY = cy - gy;
+	for (int chunk = 0; chunk < MAX_DISP; chunk += DISP_CHUNK) {
+		// the leftmost right image column the chunk reads
+		const int stripX = invertD ? groupX - D + chunk : groupX - D - (chunk + DISP_CHUNK - 1);
+		// the previous chunk is done with the strip
+		barrier(CLK_LOCAL_MEM_FENCE);
+		for (int y = gy; y < STRIP_H; y += GH) {
+			for (int x = gx; x < STRIP_W; x += GW) {
+				rightStrip[y * STRIP_PITCH + x] = rightSample(sample(right, stripX + x, groupY - D + y));
+			}
+		}
+		for (int x = gx; x < STATS_W; x += GW) {
+			rightStatsRows[gy * STATS_W + x] = read_imagef(rightStats, sampler, (int2)(stripX + D + x, cy)).xy;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		const int chunkEnd = min(chunk + DISP_CHUNK - 1, lastDisp);
+#ifdef DISP_VEC
+		// the lane groups are aligned to the chunk, which is a multiple of DISP_VEC wide
+		for (int disp0 = chunk + (max(chunk, firstDisp) - chunk) / DISP_VEC * DISP_VEC; disp0 <= chunkEnd; disp0 += DISP_VEC) {
+			const int stripCol = laneColumn(cx, disp0, invertD) - stripX;
+			float meanR[DISP_VEC], invStdR[DISP_VEC];
+			for (int k = 0; k < DISP_VEC; ++k) {
+				meanR[k] = rightStatsRows[gy * STATS_W + stripCol + k].x;
+				invStdR[k] = rightStatsRows[gy * STATS_W + stripCol + k].y;
+			}
+			floatV sum = 0.f;
+			for (int j = 0; j < WINDOW; ++j) {
+				for (int i = 0; i < WINDOW; ++i) {
+					sum += toFloatV(leftBuffer[(gy + j) * bw + gx + i] * vloadV(0, rightStrip + (gy + j) * STRIP_PITCH + stripCol + i));
+				}
+			}
+			const floatV zncc = (sum - correctionL * (vloadV(0, meanR) - RIGHT_SHIFT)) * statsL.y * vloadV(0, invStdR);
+			keepBest(zncc, laneDisparities(disp0, invertD), firstDisp, lastDisp, &bestV, &bestDispV);
+		}
+#else
+		for (int disp = max(chunk, firstDisp); disp <= chunkEnd; ++disp) {
+			const int d = invertD ? -disp : disp;
+			// the strip column of the right pixel under the left pixel of the window's first column
+			const int stripCol = cx - D - d - stripX;
+			const float2 statsR = rightStatsRows[gy * STATS_W + stripCol];
+			float sum = 0.f;
+			for (int j = 0; j < WINDOW; ++j) {
+				for (int i = 0; i < WINDOW; ++i) {
+					sum += (float)(leftBuffer[(gy + j) * bw + gx + i] * rightStrip[(gy + j) * STRIP_PITCH + stripCol + i]);
+				}
+			}
+			const float zncc = (sum - correctionL * (statsR.x - RIGHT_SHIFT)) * statsL.y * statsR.y;
+			if (zncc > bestZncc) {
+				bestZncc = zncc;
+				bestDisp = disp;
+			}
+		}
+#endif
+	}
+#elif defined(DISP_VEC)
+	// the right samples of a window row for all lanes, read once through the sampler
+	sample_t rightRow[WINDOW + DISP_VEC - 1];
+	for (int disp0 = firstDisp; disp0 <= lastDisp; disp0 += DISP_VEC) {
+		const int col0 = laneColumn(cx, disp0, invertD);
+		float meanR[DISP_VEC], invStdR[DISP_VEC];
+		for (int k = 0; k < DISP_VEC; ++k) {
+			const float2 statsR = read_imagef(rightStats, sampler, (int2)(col0 + D + k, cy)).xy;
+			meanR[k] = statsR.x;
+			invStdR[k] = statsR.y;
+		}
+		floatV sum = 0.f;
+		for (int j = 0; j < WINDOW; ++j) {
+			for (int t = 0; t < WINDOW + DISP_VEC - 1; ++t) {
+				rightRow[t] = rightSample(sample(right, col0 + t, cy - D + j));
+			}
+			for (int i = 0; i < WINDOW; ++i) {
+				sum += toFloatV(leftBuffer[(gy + j) * bw + gx + i] * vloadV(0, rightRow + i));
+			}
+		}
+		const floatV zncc = (sum - correctionL * (vloadV(0, meanR) - RIGHT_SHIFT)) * statsL.y * vloadV(0, invStdR);
+		keepBest(zncc, laneDisparities(disp0, invertD), firstDisp, lastDisp, &bestV, &bestDispV);
+	}
+#else
+	for (int disp = firstDisp; disp <= lastDisp; ++disp) {
+		const int d = invertD ? -disp : disp;
+		const float2 statsR = read_imagef(rightStats, sampler, (int2)(cx - d, cy)).xy;
 		float sum = 0.f;
 		for (int row = cy - D; row <= cy + D; ++row) {
 			for (int col = cx - D; col <= cx + D; ++col) {
 				const int bufferx = col - cx + D + gx;
 				const int buffery = row - cy + D + gy;
 				const int bufferi = buffery * bw + bufferx;
-				sum += (leftBuffer[bufferi] - meanL) * (sample(right, col - d, row) - meanR);
+				sum += (float)(leftBuffer[bufferi] * rightSample(sample(right, col - d, row)));
 			}
 		}
-		const float zncc = sum / sample(leftStd, cx, cy) / sample(rightStd, cx - d, cy);
+		const float zncc = (sum - correctionL * (statsR.x - RIGHT_SHIFT)) * statsL.y * statsR.y;
 		if (zncc > bestZncc) {
 			bestZncc = zncc;
 			bestDisp = disp;
 		}
 	}
-	write_imageui(output, (int2)(cx, cy), convert_uchar((float)bestDisp / MAX_DISP * 255.f));
+#endif
+#ifdef DISP_VEC
+	// argmax over the lanes, the smallest disparity wins a tie like in the scalar search
+	float laneBest[DISP_VEC];
+	int laneDisp[DISP_VEC];
+	vstoreV(bestV, 0, laneBest);
+	vstoreV(bestDispV, 0, laneDisp);
+	for (int k = 0; k < DISP_VEC; ++k) {
+		if (laneBest[k] > bestZncc || (laneBest[k] == bestZncc && laneBest[k] > 0.f && laneDisp[k] < bestDisp)) {
+			bestZncc = laneBest[k];
+			bestDisp = laneDisp[k];
+		}
+	}
+#endif
+	// the global range is padded to whole work-groups
+	if (cx < get_image_width(output) && cy < get_image_height(output)) {
+#ifdef RAW_DISPARITY
+		// the coarsest level of the pyramid keeps the disparity in pixels for the refinement
+		write_imageui(output, (int2)(cx, cy), bestDisp);
+#else
+		write_imageui(output, (int2)(cx, cy), convert_uchar((float)bestDisp / MAX_DISP * 255.f));
+#endif
+#ifdef TEMPORAL_RANGE
+		write_imagef(confidence, (int2)(cx, cy), bestZncc);
+#endif
+	}
 }
\ No newline at end of file
@@ -0,0 +1,123 @@
+#include "clIncludes.h"
+
+// the output pixels every work-item computes, BLOCK_X x BLOCK_Y: 1, 2 or 4 columns by 1 or 2 rows, not 1x1
+#ifndef BLOCK_X
+#define BLOCK_X 2
+#endif
+#ifndef BLOCK_Y
+#define BLOCK_Y 1
+#endif
+
+// the pixels of a work-group and the window halo around them
+#define TILE_W (GW * BLOCK_X + 2 * D)
+#define TILE_H (GH * BLOCK_Y + 2 * D)
+// the window cells the pixels of a block cover together
+#define SPAN_W (BLOCK_X + 2 * D)
+#define SPAN_H (BLOCK_Y + 2 * D)
+
+__constant const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+
+inline float sample(__read_only image2d_t in, int col, int row) {
+	return read_imagef(in, sampler, (int2)(col, row)).x;
+}
+
+
+// the disparity kernel with register blocking: neighbouring pixels share all but one column or row of their
+// windows, so every work-item scores a block of pixels together. Per disparity every right sample of the block's
+// window span is read once, its product with the left sample is computed once, and the window row sums of the
+// pixels of a block row slide along the span row, all in registers since the loop bounds are constants.
+__kernel void disparityBlock(
+	__write_only image2d_t output, __read_only image2d_t left, __read_only image2d_t right,
+	__read_only image2d_t leftStats, __read_only image2d_t rightStats, int invertD)
+{
+	const int gx = get_local_id(0);
+	const int gy = get_local_id(1);
+	// the top left pixel of the block
+	const int cx = get_global_id(0) * BLOCK_X;
+	const int cy = get_global_id(1) * BLOCK_Y;
+
+	// cache left samples relative to mid gray like disparity.cl
+	const int tileX = get_group_id(0) * GW * BLOCK_X - D;
+	const int tileY = get_group_id(1) * GH * BLOCK_Y - D;
+	__local float tile[TILE_H][TILE_W];
+	for (int ty = gy; ty < TILE_H; ty += GH) {
+		for (int tx = gx; tx < TILE_W; tx += GW) {
+			tile[ty][tx] = sample(left, tileX + tx, tileY + ty) - MID_GRAY;
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	float2 statsL[BLOCK_Y][BLOCK_X];
+	float correctionL[BLOCK_Y][BLOCK_X];
+	float bestZncc[BLOCK_Y][BLOCK_X];
+	int bestDisp[BLOCK_Y][BLOCK_X];
+	for (int by = 0; by < BLOCK_Y; ++by) {
+		for (int bx = 0; bx < BLOCK_X; ++bx) {
+			statsL[by][bx] = read_imagef(leftStats, sampler, (int2)(cx + bx, cy + by)).xy;
+			correctionL[by][bx] = (float)(WINDOW * WINDOW) * (statsL[by][bx].x - MID_GRAY);
+			bestZncc[by][bx] = 0.f;
+			bestDisp[by][bx] = 0;
+		}
+	}
+
+	// the block's span in the tile
+	const int spanX = gx * BLOCK_X;
+	const int spanY = gy * BLOCK_Y;
+	for (int disp = 0; disp < MAX_DISP; ++disp) {
+		const int d = invertD ? -disp : disp;
+		float sum[BLOCK_Y][BLOCK_X];
+		for (int by = 0; by < BLOCK_Y; ++by) {
+			for (int bx = 0; bx < BLOCK_X; ++bx) {
+				sum[by][bx] = 0.f;
+			}
+		}
+		for (int j = 0; j < SPAN_H; ++j) {
+			float products[SPAN_W];
+			for (int i = 0; i < SPAN_W; ++i) {
+				products[i] = tile[spanY + j][spanX + i] * sample(right, cx - D + i - d, cy - D + j);
+			}
+			// the window row sums of the block columns, sliding one column at a time
+			float rowSums[BLOCK_X];
+			rowSums[0] = 0.f;
+			for (int i = 0; i < WINDOW; ++i) {
+				rowSums[0] += products[i];
+			}
+			for (int bx = 1; bx < BLOCK_X; ++bx) {
+				rowSums[bx] = rowSums[bx - 1] - products[bx - 1] + products[bx - 1 + WINDOW];
+			}
+			// the span row is a window row of the block rows whose window it falls in
+			for (int by = 0; by < BLOCK_Y; ++by) {
+				if (j >= by && j < by + WINDOW) {
+					for (int bx = 0; bx < BLOCK_X; ++bx) {
+						sum[by][bx] += rowSums[bx];
+					}
+				}
+			}
+		}
+		for (int by = 0; by < BLOCK_Y; ++by) {
+			for (int bx = 0; bx < BLOCK_X; ++bx) {
+				const float2 statsR = read_imagef(rightStats, sampler, (int2)(cx + bx - d, cy + by)).xy;
+				const float zncc = (sum[by][bx] - correctionL[by][bx] * statsR.x) * statsL[by][bx].y * statsR.y;
+				if (zncc > bestZncc[by][bx]) {
+					bestZncc[by][bx] = zncc;
+					bestDisp[by][bx] = disp;
+				}
+			}
+		}
+	}
+
+	// the global range is padded to whole work-groups, and the last blocks can reach past the image
+	for (int by = 0; by < BLOCK_Y; ++by) {
+		for (int bx = 0; bx < BLOCK_X; ++bx) {
+			if (cx + bx < get_image_width(output) && cy + by < get_image_height(output)) {
+#ifdef RAW_DISPARITY
+				write_imageui(output, (int2)(cx + bx, cy + by), bestDisp[by][bx]);
+#else
+				write_imageui(output, (int2)(cx + bx, cy + by), convert_uchar((float)bestDisp[by][bx] / MAX_DISP * 255.f));
+#endif
+			}
+		}
+	}
+}
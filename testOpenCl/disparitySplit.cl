@@ -0,0 +1,91 @@
+#include "clIncludes.h"
+
+// the work-items sharing the disparity range of a pixel, a power of two
+#ifndef DISP_LANES
+#define DISP_LANES 16
+#endif
+// the side length of the square of pixels a work-group scores
+#ifndef SPLIT_TILE
+#define SPLIT_TILE 4
+#endif
+#define TILE_SIDE (SPLIT_TILE + 2 * D)
+#define TILE_PIXELS (SPLIT_TILE * SPLIT_TILE)
+
+__constant const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+
+inline float sample(__read_only image2d_t in, int col, int row) {
+	return read_imagef(in, sampler, (int2)(col, row)).x;
+}
+
+
+// the disparity kernel for small images: the third dimension of the NDRange splits the disparity range of every
+// pixel over DISP_LANES work-items, so a frame of a few thousand pixels still fills a large device. Lane l scores
+// the disparities l, l + DISP_LANES, ... and the lanes of a pixel reduce their best scores in local memory.
+__kernel void disparitySplit(
+	__write_only image2d_t output, __read_only image2d_t left, __read_only image2d_t right,
+	__read_only image2d_t leftStats, __read_only image2d_t rightStats, int invertD)
+{
+	const int lx = get_local_id(0);
+	const int ly = get_local_id(1);
+	const int lane = get_local_id(2);
+	const int cx = get_global_id(0);
+	const int cy = get_global_id(1);
+
+	// all lanes load the left tile together, relative to mid gray like disparity.cl
+	__local float tile[TILE_SIDE][TILE_SIDE];
+	const int tileX = get_group_id(0) * SPLIT_TILE - D;
+	const int tileY = get_group_id(1) * SPLIT_TILE - D;
+	for (int i = (lane * SPLIT_TILE + ly) * SPLIT_TILE + lx; i < TILE_SIDE * TILE_SIDE; i += TILE_PIXELS * DISP_LANES) {
+		tile[i / TILE_SIDE][i % TILE_SIDE] = sample(left, tileX + i % TILE_SIDE, tileY + i / TILE_SIDE) - MID_GRAY;
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	const float2 statsL = read_imagef(leftStats, sampler, (int2)(cx, cy)).xy;
+	const float correctionL = (float)(WINDOW * WINDOW) * (statsL.x - MID_GRAY);
+	float bestZncc = 0.f;
+	int bestDisp = 0;
+	for (int disp = lane; disp < MAX_DISP; disp += DISP_LANES) {
+		const int d = invertD ? -disp : disp;
+		float sum = 0.f;
+		for (int j = 0; j < WINDOW; ++j) {
+			for (int i = 0; i < WINDOW; ++i) {
+				sum += tile[ly + j][lx + i] * sample(right, cx - D + i - d, cy - D + j);
+			}
+		}
+		const float2 statsR = read_imagef(rightStats, sampler, (int2)(cx - d, cy)).xy;
+		const float zncc = (sum - correctionL * statsR.x) * statsL.y * statsR.y;
+		if (zncc > bestZncc) {
+			bestZncc = zncc;
+			bestDisp = disp;
+		}
+	}
+
+	// tree reduction over the lanes of every pixel, ties go to the smaller disparity like the serial search
+	__local float laneZncc[DISP_LANES][TILE_PIXELS];
+	__local int laneDisp[DISP_LANES][TILE_PIXELS];
+	const int pixel = ly * SPLIT_TILE + lx;
+	laneZncc[lane][pixel] = bestZncc;
+	laneDisp[lane][pixel] = bestDisp;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int stride = DISP_LANES / 2; stride > 0; stride /= 2) {
+		if (lane < stride) {
+			const float otherZncc = laneZncc[lane + stride][pixel];
+			const int otherDisp = laneDisp[lane + stride][pixel];
+			if (otherZncc > laneZncc[lane][pixel] || (otherZncc == laneZncc[lane][pixel] && otherDisp < laneDisp[lane][pixel])) {
+				laneZncc[lane][pixel] = otherZncc;
+				laneDisp[lane][pixel] = otherDisp;
+			}
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (lane == 0 && cx < get_image_width(output) && cy < get_image_height(output)) {
+#ifdef RAW_DISPARITY
+		write_imageui(output, (int2)(cx, cy), laneDisp[0][pixel]);
+#else
+		write_imageui(output, (int2)(cx, cy), convert_uchar((float)laneDisp[0][pixel] / MAX_DISP * 255.f));
+#endif
+	}
+}
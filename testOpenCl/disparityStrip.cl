@@ -0,0 +1,81 @@
+#include "clIncludes.h"
+
+// the pixels of a row every work-item walks
+#ifndef STRIP_LEN
+#define STRIP_LEN 32
+#endif
+
+__constant const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+
+inline float sample(__read_only image2d_t in, int col, int row) {
+	return read_imagef(in, sampler, (int2)(col, row)).x;
+}
+
+
+// the correlation products of a window column, left samples relative to mid gray like disparity.cl
+inline float columnSum(__read_only image2d_t left, __read_only image2d_t right, int col, int row, int d) {
+	float sum = 0.f;
+	for (int j = -D; j <= D; ++j) {
+		sum += (sample(left, col, row + j) - MID_GRAY) * sample(right, col - d, row + j);
+	}
+	return sum;
+}
+
+
+// the disparity kernel as sliding window sums: every work-item walks STRIP_LEN pixels of a row once per disparity.
+// The window sum moves one pixel by adding the column sum entering the window and subtracting the one leaving it,
+// kept in a private ring, so a pixel costs 2 WINDOW products per disparity instead of WINDOW squared. The reads
+// walk along the rows, which suits the caches of CPU devices.
+__kernel void disparityStrip(
+	__write_only image2d_t output, __read_only image2d_t left, __read_only image2d_t right,
+	__read_only image2d_t leftStats, __read_only image2d_t rightStats, int invertD)
+{
+	const int x0 = get_global_id(0) * STRIP_LEN;
+	const int y = get_global_id(1);
+	const int width = get_image_width(output);
+	const int length = min(STRIP_LEN, width - x0);
+
+	float bestZncc[STRIP_LEN];
+	int bestDisp[STRIP_LEN];
+	for (int i = 0; i < STRIP_LEN; ++i) {
+		bestZncc[i] = 0.f;
+		bestDisp[i] = 0;
+	}
+
+	for (int disp = 0; disp < MAX_DISP; ++disp) {
+		const int d = invertD ? -disp : disp;
+		// the column sums of the window of the previous pixel, the oldest at `oldest`
+		float columns[WINDOW];
+		float sum = 0.f;
+		for (int i = 0; i < WINDOW - 1; ++i) {
+			columns[i] = columnSum(left, right, x0 - D + i, y, d);
+			sum += columns[i];
+		}
+		columns[WINDOW - 1] = 0.f;
+		int oldest = WINDOW - 1;
+		for (int i = 0; i < length; ++i) {
+			const int x = x0 + i;
+			const float incoming = columnSum(left, right, x + D, y, d);
+			sum += incoming - columns[oldest];
+			columns[oldest] = incoming;
+			oldest = oldest == WINDOW - 1 ? 0 : oldest + 1;
+
+			const float2 statsL = read_imagef(leftStats, sampler, (int2)(x, y)).xy;
+			const float2 statsR = read_imagef(rightStats, sampler, (int2)(x - d, y)).xy;
+			const float zncc = (sum - (float)(WINDOW * WINDOW) * (statsL.x - MID_GRAY) * statsR.x) * statsL.y * statsR.y;
+			if (zncc > bestZncc[i]) {
+				bestZncc[i] = zncc;
+				bestDisp[i] = disp;
+			}
+		}
+	}
+
+	for (int i = 0; i < length; ++i) {
+#ifdef RAW_DISPARITY
+		write_imageui(output, (int2)(x0 + i, y), bestDisp[i]);
+#else
+		write_imageui(output, (int2)(x0 + i, y), convert_uchar((float)bestDisp[i] / MAX_DISP * 255.f));
+#endif
+	}
+}
@@ -0,0 +1,92 @@
+#ifndef BATCHRUNNER_HPP
+#define BATCHRUNNER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "CL/cl.hpp"
+#include "ClUtils.hpp"
+
+
+namespace ClUtils {
+
+/// The input and output png paths of one stereo pair.
+struct StereoPair {
+	std::string left;
+	std::string right;
+	std::string output;
+};
+
+/// Reads a manifest of stereo pairs. Every non-empty line which does not start with '#' holds the left and the
+/// right image path and optionally the output path, separated by whitespace. Relative paths are relative to the
+/// directory of the manifest. Without an output path the map is written next to the left image as `<left>_disp.png`.
+/// \param path The path of the manifest file.
+/// \param failed Outputs the number of pairs which could not be read: one if the manifest cannot be opened, plus the
+/// lines without a right image. They are logged.
+/// \param outputDirectory The directory of the default output paths instead of the left image's one. Empty for none.
+/// \return The pairs in manifest order.
+std::vector<StereoPair>	readPairManifest(const std::string& path, unsigned& failed, const std::string& outputDirectory = "");
+
+/// Finds the stereo pairs of a directory in the Middlebury layout: every subdirectory holding an `im0.png` and
+/// an `im1.png` is a pair, and so is the directory itself if it holds them. The map is written to `disp.png` in
+/// the pair's directory.
+/// \param directory The directory to search.
+/// \param failed Outputs one if the directory cannot be listed, which is logged, zero otherwise.
+/// \param outputDirectory The directory to write `<pair directory name>.png` files to instead. Empty for none.
+/// \return The pairs sorted by path.
+std::vector<StereoPair>	findPairs(const std::string& directory, unsigned& failed, const std::string& outputDirectory = "");
+
+/// Processes a series of stereo pairs on one context as a pipeline: png decode, upload and compute submission,
+/// readback and png encode run on their own threads connected by bounded queues, so the decoding and encoding
+/// of some pairs overlap the device work of others. The context, the programs and the pooled images are reused
+/// across the whole batch, and so are the host buffers of a fixed set of frames.
+class BatchRunner {
+public:
+	/// \param clCtx The OpenCL context to use.
+	/// \param params The algorithm parameters, fitted to the device of the context.
+	/// \param framesInFlight The number of pairs being processed at once, in any of the stages.
+	BatchRunner(const cl::Context& clCtx, const DisparityParams& params, unsigned framesInFlight = 4);
+
+	/// Computes and saves the disparity maps of the pairs. A pair which cannot be loaded, computed or saved is
+	/// logged and counted as failed, the rest of the batch goes on.
+	/// \param pairs The pairs to process.
+	/// \return The number of pairs which failed.
+	unsigned	run(const std::vector<StereoPair>& pairs);
+
+	/// Logs the number of processed pairs and the sustained throughput of the last `run`.
+	void		logStats() const;
+
+private:
+	typedef std::chrono::steady_clock	Clock;
+
+	/// The host side state of one pair moving through the stages. Its buffers are reused by later pairs.
+	struct Frame {
+		const StereoPair*		pair;
+		std::vector<uint8_t>	pixelsL;
+		std::vector<uint8_t>	pixelsR;
+		std::vector<uint8_t>	disparity;
+		unsigned				width;
+		unsigned				height;
+		unsigned				outWidth;
+		unsigned				outHeight;
+		cl::Image2D				image;
+		cl::Event				ready;
+		bool					ok;
+	};
+
+	cl::Context			m_context;
+	cl::CommandQueue	m_leftQueue;
+	cl::CommandQueue	m_rightQueue;
+	cl::CommandQueue	m_readQueue;
+	DisparityParams		m_params;
+	unsigned			m_framesInFlight;
+	unsigned			m_pairs;
+	unsigned			m_failed;
+	double				m_seconds;			///< The wall time of the last run.
+	double				m_firstPairSeconds;	///< The time until the first pair was saved, including the program builds.
+};
+
+}	// namespace ClUtils
+
+#endif
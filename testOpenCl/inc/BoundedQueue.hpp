@@ -0,0 +1,70 @@
+#ifndef BOUNDEDQUEUE_HPP
+#define BOUNDEDQUEUE_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+
+namespace ClUtils {
+
+/// A blocking FIFO with a fixed capacity, connecting the stages of a pipeline running on separate threads.
+/// A full queue blocks the producer, so a fast stage cannot run ahead of a slow one without bound.
+template<typename T>
+class BoundedQueue {
+public:
+	/// \param capacity The largest number of items the queue holds.
+	explicit BoundedQueue(size_t capacity)
+		: m_capacity(capacity > 0 ? capacity : 1), m_closed(false) {
+	}
+
+	/// Appends an item, waiting while the queue is full.
+	/// \param item The item to append.
+	/// \return False if the queue was closed, in which case the item is dropped.
+	bool		push(T item) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notFull.wait(lock, [this]() { return m_closed || m_items.size() < m_capacity; });
+		if (m_closed) {
+			return false;
+		}
+		m_items.push_back(std::move(item));
+		m_notEmpty.notify_one();
+		return true;
+	}
+
+	/// Removes the oldest item, waiting while the queue is empty.
+	/// \param item Outputs the removed item.
+	/// \return False if the queue is closed and drained.
+	bool		pop(T& item) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notEmpty.wait(lock, [this]() { return m_closed || !m_items.empty(); });
+		if (m_items.empty()) {
+			return false;
+		}
+		item = std::move(m_items.front());
+		m_items.pop_front();
+		m_notFull.notify_one();
+		return true;
+	}
+
+	/// Marks the end of the input. The queued items can still be popped, further pushes fail.
+	void		close() {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closed = true;
+		m_notEmpty.notify_all();
+		m_notFull.notify_all();
+	}
+
+private:
+	const size_t			m_capacity;
+	bool					m_closed;
+	std::deque<T>			m_items;
+	std::mutex				m_mutex;
+	std::condition_variable	m_notEmpty;
+	std::condition_variable	m_notFull;
+};
+
+}	// namespace ClUtils
+
+#endif
@@ -2,12 +2,17 @@
 #define CLUTILS_HPP
 
 #include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
 #include "CL/cl.hpp"
 
 
 /// A collection of helper functions implementing the disparity algorithm with OpenCL.
 namespace ClUtils {
 
+struct DeviceCaps;
+
 /// Contains the result of the function `precalcImage`. It contains the precalculated downscaled 
 /// grayscale image of the original, the image with the window standard deviations and the image
 /// with the window means.
@@ -16,48 +21,306 @@ struct PrecalcImage {
 	cl::Image2D grayImg;
 	cl::Image2D means;
 	cl::Image2D stdDev;
+	cl::Image2D stats;	///< The `CL_RG` image of the window means and the reciprocal standard deviations, zero for flat windows.
+	cl::Event ready;	///< Completes when all of the images above are computed.
+};
+
+/// Selects the kernels computing the gray, mean and standard deviation images in `precalcImage`.
+enum class PrecalcEngine {
+	/// The `preprocess`, `mean` and `stdDev` kernels, each reading the previous one's output.
+	Separate,
+	/// The single `precalc` kernel, which computes all three images from a local memory tile.
+	Fused,
+	/// The `preprocess` kernel followed by the summed-area tables of `integral.cl`. The mean and standard
+	/// deviation cost the same for any window size, which pays off for large windows. Exact for windows up to 89.
+	Integral,
+	/// The `preprocess` kernel followed by the separable box filter of `boxFilter.cl`, which sums the rows and then
+	/// the columns of a local memory tile in O(WINDOW) per pixel.
+	Separable,
+	/// Chosen by `DisparityParams::fitToDevice` from the device capabilities and the window size. Behaves like
+	/// `PrecalcEngine::Separate` where it is not resolved.
+	Auto
+};
+
+/// Selects the kernels computing the ZNCC scores in `calculateDisparityMap`.
+enum class DisparityEngine {
+	/// The `disparity` kernel, which sums the whole correlation window for every disparity.
+	Window,
+	/// The kernels of `costVolume.cl`, which box filter the correlation products of every disparity with sliding
+	/// sums, so the cost per disparity does not depend on the window size. The temporal search uses `Window`.
+	CostVolume,
+	/// The `disparityStrip` kernel, whose work-items walk a strip of a row with sliding sums of the correlation
+	/// columns, so a pixel costs O(WINDOW) per disparity without a volume in memory. Suits CPU devices. The
+	/// temporal search uses `Window`.
+	Strip
+};
+
+/// Selects the channel type of the gray, mean, standard deviation and statistics images.
+enum class StoragePrecision {
+	/// 32-bit float channels.
+	Float,
+	/// `CL_HALF_FLOAT` channels, which halve the memory traffic of the kernels reading them. On devices with
+	/// `cl_khr_fp16` the disparity kernel also caches its tiles and multiplies in half, see `DisparityParams::halfMath`.
+	Half
+};
+
+/// Parameters of the disparity algorithm. The numeric parameters are compiled into the kernels as preprocessor
+/// constants, so the kernel loops keep compile-time bounds. Every distinct parameter set gets its own program
+/// build in the `ClUtils::ProgramCache`. The engine fields select between kernel variants.
+struct DisparityParams {
+	unsigned window = 9;		///< The side length of the square correlation window. Must be odd, `fitToDevice` rounds an even one up.
+	unsigned maxDisp = 65;		///< The number of disparity candidates searched per pixel.
+	unsigned crossTh = 8;		///< The largest difference of the left and right disparity accepted by the cross-check.
+	unsigned maxOffset = 50;	///< The largest distance the occlusion fill searches for a valid pixel.
+	unsigned groupWidth = 15;	///< The work-group width of the disparity kernel.
+	unsigned groupHeight = 8;	///< The work-group height of the disparity kernel.
+	float downscale = 4.f;		///< The input is this many times larger than the gray image searched. Can be non-integer, must be at least 1.
+	PrecalcEngine precalcEngine = PrecalcEngine::Fused;
+	DisparityEngine disparityEngine = DisparityEngine::Window;
+	unsigned dispChunk = 0;					///< The disparities the `disparity` kernel caches a right image strip for at once, see `fitToDevice`. Zero reads the right image through the sampler.
+	unsigned dispVector = 0;				///< The disparities the `disparity` kernel scores at once in vector lanes: 4, 8 or 16, see `fitToDevice`. Zero scores one at a time.
+	unsigned dispLanes = 0;					///< The work-items splitting the disparity range of a pixel on small images, see `fitToDevice` and `disparitySplit.cl`. Zero disables the split.
+	unsigned stripLength = 32;				///< The pixels of a row every work-item of `DisparityEngine::Strip` walks.
+	unsigned blockWidth = 1;				///< The output columns every work-item of the disparity kernel computes: 1, 2 or 4, see `disparityBlock.cl`. `fitToDevice` clamps other values.
+	unsigned blockHeight = 1;				///< The output rows every work-item of the disparity kernel computes: 1 or 2. `fitToDevice` clamps other values.
+	StoragePrecision storage = StoragePrecision::Float;
+	bool halfMath = false;					///< Half tiles and products with float sums in the `disparity` kernel, set by `fitToDevice` for half storage.
+	unsigned temporalRange = 0;				///< The half width of the temporal search around the previous disparity. Zero disables it.
+	float temporalMinConfidence = 0.6f;		///< The lowest ZNCC score of the previous frame the temporal search trusts.
+	float temporalMaxChange = 8.f;			///< The largest change of the window mean, in gray levels, the temporal search trusts.
+	unsigned pyramidLevels = 0;				///< The levels of the coarse-to-fine search, see `pyramidDisparityMap`. Below 2 disables it.
+	unsigned refineRange = 2;				///< The search radius of the finer pyramid levels around the doubled coarser disparity.
+
+	/// \return The -D options defining the parameters for the OpenCL compiler.
+	std::string	buildOptions() const;
+
+	/// \return The channel type of the gray, mean, standard deviation and statistics images for `storage`.
+	cl_channel_type	imageType() const;
+
+	/// Rounds an even `window` up to the next odd size, the kernels need a center pixel.
+	/// Shrinks the work-group size until it fits the work-group size and local memory limits of the device.
+	/// The tiled kernels use the same work-group size. Resolves `PrecalcEngine::Auto`: the summed-area tables for
+	/// windows wider than 25 pixels and on devices emulating local memory, the separable box filter on the others.
+	/// On devices with dedicated local memory, sets `dispChunk` to the most disparities whose right image strip
+	/// fits in the local memory left by the disparity kernel's left tile, evened out over the chunks of the range.
+	/// Sets `dispVector` to the preferred float vector width of the device, if it is at least 4, and rounds
+	/// `dispChunk` to a multiple of it. Falls back to float storage where the device cannot use half images, and
+	/// sets `halfMath` for half storage on devices with `cl_khr_fp16`. The local memory budget accounts for the
+	/// larger left tile of a blocked disparity kernel. Sets `dispLanes` to the most lanes, up to 16, whose work-group
+	/// fits the device, except on CPU devices whose few hardware threads are filled by any image.
+	/// \param caps The capabilities of the device the kernels will run on.
+	/// \return The adapted parameters.
+	DisparityParams	fitToDevice(const DeviceCaps& caps) const;
+};
+
+/// The previous frame of one disparity direction in a video, seeding the temporal search of the next frame.
+/// The images belong to the frame and go back to the image pool when they are replaced.
+struct TemporalFrame {
+	cl::Image2D disparity;		///< The disparity map before the cross-check.
+	cl::Image2D confidence;		///< The best ZNCC score of every pixel.
+	cl::Image2D means;			///< The window means of the image the disparity map belongs to.
+	cl::Event ready;			///< Completes when the images above are computed.
+};
+
+/// The state the temporal search carries between the frames of a video, see `DisparityParams::temporalRange`.
+struct TemporalState {
+	TemporalFrame left;			///< The left-to-right pass.
+	TemporalFrame right;		///< The right-to-left pass.
+};
+
+/// Contains the result of the function `computeDisparity`: the final disparity map and its size.
+struct DisparityResult {
+	const unsigned width, height;
+	cl::Image2D image;
+	cl::Event ready;	///< Completes when the disparity map is computed.
+};
+
+/// Controls how `runKernel` synchronizes with the device.
+enum class ExecutionMode {
+	/// Waits for every kernel right after enqueueing it and logs its execution time immediately.
+	Blocking,
+	/// Only enqueues the kernels, chained by their events. The execution times are logged by `logKernelTimes`.
+	EventGraph
+};
+
+/// Controls how the input and output images move between the host and the device.
+enum class TransferMode {
+	/// `TransferMode::ZeroCopy` on devices sharing memory with the host, `TransferMode::Copy` on the others.
+	Auto,
+	/// Uploads the input with a write and reads the output back into a host vector.
+	Copy,
+	/// Copies the decoded input into a mapping of a pooled `CL_MEM_ALLOC_HOST_PTR` image the kernels read in place,
+	/// and reads or encodes the output from a mapping of such an image. On CPU devices and integrated GPUs the device
+	/// makes no copies. The host still copies the pixels once each way, because the png decoder and encoder work on
+	/// their own vectors, so this saves the runtime's staging copies and not the host `memcpy`.
+	ZeroCopy
+};
+
+/// Thrown by `error_quit_program` instead of quitting on a thread with a live `ThrowOnError`.
+class ClError : public std::runtime_error {
+public:
+	/// \param code The error code which was checked.
+	explicit ClError(int code) : std::runtime_error("OpenCL error " + std::to_string(code)), m_code(code) {
+	}
+
+	/// \return The error code which was checked.
+	int		code() const {
+		return m_code;
+	}
+
+private:
+	int		m_code;
+};
+
+/// \return Whether `error_quit_program` throws on the calling thread, see `ThrowOnError`.
+inline bool&	throwOnErrorFlag() {
+	static thread_local bool throwOnError = false;
+	return throwOnError;
+}
+
+/// While alive, makes `error_quit_program` throw `ClError` on the thread which created it, so unattended work
+/// like a batch worker can fail one item and go on. Nests.
+class ThrowOnError {
+public:
+	ThrowOnError() : m_previous(throwOnErrorFlag()) {
+		throwOnErrorFlag() = true;
+	}
+
+	~ThrowOnError() {
+		throwOnErrorFlag() = m_previous;
+	}
+
+	ThrowOnError(const ThrowOnError&) = delete;
+	ThrowOnError&	operator=(const ThrowOnError&) = delete;
+
+private:
+	bool	m_previous;
 };
 
-/// If the error is not zero, waits for user input then quits the program.
+/// If the error is not zero, waits for user input then quits the program, or throws `ClError` under a `ThrowOnError`.
 /// \param error The error code to check.
 template<typename T>
 void		error_quit_program(T error) {
 	if (error != 0) {
+		if (throwOnErrorFlag()) {
+			throw ClError(static_cast<int>(error));
+		}
 		getchar();
 		exit(1);
 	}
 }
 
-/// Selects the platform and device to run the OpenCL kernels on.
+/// Rounds the value up to the next multiple. Used to pad global NDRanges to whole work-groups.
+/// \param value The value to round.
+/// \param multiple The multiple to round to.
+/// \return The rounded value.
+inline unsigned	roundUp(unsigned value, unsigned multiple) {
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+/// Selects the platform and device to run the OpenCL kernels on, see `ClUtils::selectDevice`.
+/// \param deviceOverride The device to use instead of the best scoring one. Empty for no override.
 /// \return The cl::Context containing the device settings.
-cl::Context	initCl();
+cl::Context	initCl(const std::string& deviceOverride = "");
+
+/// Sets the execution mode used by `runKernel` and `createQueue`. Defaults to `ExecutionMode::EventGraph`.
+/// \param mode The execution mode to use.
+void		setExecutionMode(ExecutionMode mode);
+
+/// Sets the transfer mode used by `precalcImage`, `fillOcclusions`, `readGrayImage` and `saveGrayImage`. Defaults to `TransferMode::Auto`.
+/// \param mode The transfer mode to use.
+void		setTransferMode(TransferMode mode);
+
+/// Resolves the transfer mode for a context.
+/// \param clCtx The OpenCL context to use.
+/// \return Whether the transfers of the context are zero-copy.
+bool		zeroCopyTransfers(const cl::Context& clCtx);
+
+/// Creates a profiling command queue on the first device of the context. In `ExecutionMode::EventGraph`
+/// the queue is out-of-order when the device supports it, so only the event dependencies order the kernels.
+/// \param clCtx The OpenCL context to use.
+/// \return The command queue.
+cl::CommandQueue	createQueue(const cl::Context& clCtx);
 
 /// Reads the text file on the given path to an std::string.
 /// \param filename The location of the text file.
 /// \return The content of the text file.
 std::string	readFile(const char* filename);
 
-/// Loads and builds an OpenCL kernel read from a text file.
+/// Loads and builds an OpenCL kernel read from a text file. The built program is kept in the
+/// `ClUtils::ProgramCache` of the context, so each file is compiled only once per option set.
 /// \param clCtx The OpenCL context to use.
 /// \param filename The path of the .cl file.
 /// \param kernelname The name of the kernel function.
+/// \param options The build options passed to the OpenCL compiler.
 /// \return The loaded and built OpenCL kernel.
-cl::Kernel	loadKernel(const cl::Context& clCtx, const char* filename, const char* kernelname);
+cl::Kernel	loadKernel(const cl::Context& clCtx, const char* filename, const char* kernelname, const std::string& options = "");
+
+/// Creates an OpenCL image buffer object on the device. The image comes from the `ClUtils::ImagePool` of the context,
+/// so it is a recycled one when possible. Give it back with `releaseImage` once it is not needed.
+/// \param clCtx The OpenCL context to use.
+/// \param width The width of the image in pixels.
+/// \param height The height of the image in pixels.
+/// \param channelType The data type of the image. Defaults to float.
+/// \param flags The memory flags of the image.
+/// \return The OpenCL image handle object.
+cl::Image2D	createGrayClImage(const cl::Context& clCtx, unsigned width, unsigned height, cl_channel_type channelType = CL_FLOAT,
+							cl_mem_flags flags = CL_MEM_READ_WRITE);
 
-/// Creates an OpenCL image buffer object on the device.
+/// Creates the `CL_RG` float image of the packed window statistics, see `PrecalcImage::stats`. It comes from
+/// the `ClUtils::ImagePool` of the context like the images of `createGrayClImage`.
 /// \param clCtx The OpenCL context to use.
 /// \param width The width of the image in pixels.
 /// \param height The height of the image in pixels.
 /// \param channelType The data type of the image. Defaults to float.
 /// \return The OpenCL image handle object.
-cl::Image2D	createGrayClImage(const cl::Context& clCtx, unsigned width, unsigned height, cl_channel_type channelType = CL_FLOAT);
+cl::Image2D	createStatsClImage(const cl::Context& clCtx, unsigned width, unsigned height, cl_channel_type channelType = CL_FLOAT);
+
+/// Gives an image created by `createGrayClImage` back to the image pool of the context.
+/// \param clCtx The OpenCL context to use.
+/// \param image The image to release.
+/// \param lastUses The events of the last commands using the image. The image is recycled after they complete.
+void		releaseImage(const cl::Context& clCtx, const cl::Image2D& image, const std::vector<cl::Event>& lastUses);
 
-/// Adds the given kernel to the given command queue. The kernel arguments need to be preset. Logs the execution time as well.
+/// Creates a read-write OpenCL buffer for intermediate results. Like the images of `createGrayClImage` it comes from
+/// the `ClUtils::ImagePool` of the context, give it back with `releaseBuffer` once it is not needed.
+/// \param clCtx The OpenCL context to use.
+/// \param bytes The size of the buffer in bytes.
+/// \return The OpenCL buffer handle object.
+cl::Buffer	createScratchBuffer(const cl::Context& clCtx, size_t bytes);
+
+/// Gives a buffer created by `createScratchBuffer` back to the image pool of the context.
+/// \param clCtx The OpenCL context to use.
+/// \param buffer The buffer to release.
+/// \param lastUses The events of the last commands using the buffer. The buffer is recycled after they complete.
+void		releaseBuffer(const cl::Context& clCtx, const cl::Buffer& buffer, const std::vector<cl::Event>& lastUses);
+
+/// Gives the images of a `ClUtils::PrecalcImage` back to the image pool of the context.
+/// \param clCtx The OpenCL context to use.
+/// \param image The precalculated images to release.
+/// \param lastUses The events of the last commands using the images.
+void		releasePrecalcImage(const cl::Context& clCtx, const PrecalcImage& image, const std::vector<cl::Event>& lastUses);
+
+/// Adds the given kernel to the given command queue. The kernel arguments need to be preset. Logs the execution time as well,
+/// right away in `ExecutionMode::Blocking`, or on the next `logKernelTimes` call in `ExecutionMode::EventGraph`.
 /// \param queue The OpenCL command queue to use.
 /// \param kernel The OpenCL kernel to use.
 /// \param globalRange The global NDRange to use for the kernel.
 /// \param progressname The string used in logging messages.
-void		runKernel(const cl::CommandQueue& queue, const cl::Kernel& kernel, const cl::NDRange& globalRange, const char* progressname, const cl::NDRange& localRange = cl::NullRange);
+/// \param localRange The local NDRange to use for the kernel.
+/// \param waitEvents The events the kernel has to wait for. Can be `nullptr`.
+/// \return The event of the kernel execution.
+cl::Event	runKernel(const cl::CommandQueue& queue, const cl::Kernel& kernel, const cl::NDRange& globalRange, const char* progressname,
+					const cl::NDRange& localRange = cl::NullRange, const std::vector<cl::Event>* waitEvents = nullptr);
+
+/// Waits for the kernels enqueued by `runKernel` since the last call, then logs their execution times
+/// from the retained profiling events, and for every device how much of the kernel time overlapped.
+void		logKernelTimes();
+
+/// Enables or disables recording the kernels for `logKernelTimes` in `ExecutionMode::EventGraph`. Enabled by
+/// default. Long batches disable it, the retained events would pile up otherwise.
+/// \param enabled Whether to record the kernels.
+void		setKernelTimeLogging(bool enabled);
 
 /// Decodes a png image on the disk and loads it to the memory.
 /// \param filename The path of the image file to load.
@@ -66,13 +329,77 @@ void		runKernel(const cl::CommandQueue& queue, const cl::Kernel& kernel, const c
 /// \return The image data vector.
 std::vector<uint8_t>	loadImage(const char* filename, unsigned& width, unsigned& height);
 
+/// Decodes a png image on the disk into an existing vector, reusing its capacity.
+/// \param filename The path of the image file to load.
+/// \param width Outputs the width of the loaded image.
+/// \param height Outputs the height of the loaded image.
+/// \param pixels Outputs the image data.
+void		loadImage(const char* filename, unsigned& width, unsigned& height, std::vector<uint8_t>& pixels);
+
 /// From an input RGB pixel data, creates a downscaled grayscale, a mean filtered and a standard deviation OpenCL image.
+/// The gray image is `DisparityParams::downscale` times smaller, every pixel being the area average of its footprint.
+/// \param clCtx The OpenCL context to use.
+/// \param queue The OpenCL command queue to use.
+/// \param pixels The RGB pixel data to process. It is uploaded asynchronously, or read in place by the kernels in
+/// `TransferMode::ZeroCopy`, so it must stay valid and unchanged until `ready` completes.
+/// \param width The width of the input image.
+/// \param height The height of the input image.
+/// \param params The algorithm parameters to build the kernels with.
+/// \return The precalculated images. Its `ready` event completes when they are computed.
+PrecalcImage	precalcImage(const cl::Context& clCtx, const cl::CommandQueue& queue, std::vector<uint8_t>& pixels, unsigned width, unsigned height,
+							const DisparityParams& params = DisparityParams());
+
+/// Moves RGBA pixel data to a pooled OpenCL image. In `TransferMode::ZeroCopy` the pixels are copied into a mapping
+/// of a host accessible image before this returns, otherwise the image is written asynchronously and the pixels must
+/// stay valid and unchanged until the upload is done.
+/// \param clCtx The OpenCL context to use.
+/// \param queue The OpenCL command queue to use.
+/// \param pixels The RGBA pixel data.
+/// \param width The width of the image.
+/// \param height The height of the image.
+/// \param uploadDone Outputs the events the users of the image have to wait for. Empty if there are none.
+/// \return The input image. Release it with `releaseImage` when it is not used any more.
+cl::Image2D		uploadInputImage(const cl::Context& clCtx, const cl::CommandQueue& queue, std::vector<uint8_t>& pixels, unsigned width, unsigned height,
+								std::vector<cl::Event>& uploadDone);
+
+/// Computes the precalculated images from an RGBA image already on the device.
 /// \param clCtx The OpenCL context to use.
 /// \param queue The OpenCL command queue to use.
-/// \param pixels The RGB pixel data to process.
+/// \param input The RGBA input image with `CL_UNSIGNED_INT8` channels.
 /// \param width The width of the input image.
 /// \param height The height of the input image.
-PrecalcImage	precalcImage(const cl::Context& clCtx, const cl::CommandQueue& queue, std::vector<uint8_t>& pixels, unsigned width, unsigned height);
+/// \param params The algorithm parameters to build the kernels with.
+/// \param waitEvents The events producing the input image. Can be `nullptr`.
+/// \return The precalculated images. Its `ready` event completes when they are computed.
+PrecalcImage	precalcImage(const cl::Context& clCtx, const cl::CommandQueue& queue, const cl::Image2D& input, unsigned width, unsigned height,
+							const DisparityParams& params, const std::vector<cl::Event>* waitEvents);
+
+/// Computes the window means and standard deviations of a gray image. With `PrecalcEngine::Integral` they
+/// are derived from summed-area tables in O(1) per pixel, with `PrecalcEngine::Separable` from row and column
+/// sums in O(WINDOW), otherwise every pixel sums its whole window.
+/// \param clCtx The OpenCL context to use.
+/// \param queue The OpenCL command queue to use.
+/// \param gray The gray image. It becomes the `grayImg` of the result.
+/// \param width The width of the gray image.
+/// \param height The height of the gray image.
+/// \param params The algorithm parameters to build the kernels with.
+/// \param grayDone The event producing the gray image.
+/// \return The precalculated images. Its `ready` event completes when they are computed.
+PrecalcImage	windowStatistics(const cl::Context& clCtx, const cl::CommandQueue& queue, const cl::Image2D& gray, unsigned width, unsigned height,
+								const DisparityParams& params, const cl::Event& grayDone);
+
+/// Times `windowStatistics` with every engine reading a gray image, the direct `mean` and `stdDev` kernels first,
+/// and logs the time per image and the largest difference of the results from the direct kernels.
+/// \param clCtx The OpenCL context to use.
+/// \param queue The OpenCL command queue to use.
+/// \param pixels The RGBA pixel data of the image.
+/// \param width The width of the image.
+/// \param height The height of the image.
+/// \param params The algorithm parameters to build the kernels with. The statistics are stored as floats whatever
+/// `DisparityParams::storage` says, so they read back as floats.
+/// \param repeats The number of timed runs per engine, after an untimed one building the programs.
+void		benchmarkWindowStatistics(const cl::Context& clCtx, const cl::CommandQueue& queue, std::vector<uint8_t>& pixels,
+									unsigned width, unsigned height, const DisparityParams& params, unsigned repeats);
 
 /// Runs the disparity map calculation kernel on pair of `ClUtils::PrecalcImage`-s.
 /// \param clCtx The OpenCL context to use.
@@ -80,8 +407,129 @@ PrecalcImage	precalcImage(const cl::Context& clCtx, const cl::CommandQueue& queu
 /// \param left The left image and preprocessing data.
 /// \param right The right image and preprocessing data.
 /// \param invertD When the left and right image are mixed up for post-processing purposes, this has to be set `true`.
+/// \param params The algorithm parameters to build the kernel with.
+/// \param event Outputs the event completing when the disparity map is computed. Can be `nullptr`.
+/// \param temporal The previous frame of the same direction when `DisparityParams::temporalRange` is set. The pixels it
+/// is confident about are only searched around their previous disparity. It is replaced by the computed frame, whose
+/// disparity map then belongs to it. Can be `nullptr`, or empty for the first frame, to search the full range.
 /// \return The result disparity map.
-cl::Image2D		calculateDisparityMap(const cl::Context& clCtx, const cl::CommandQueue& queue, const PrecalcImage& left, const PrecalcImage& right, bool invertD);
+cl::Image2D		calculateDisparityMap(const cl::Context& clCtx, const cl::CommandQueue& queue, const PrecalcImage& left, const PrecalcImage& right, bool invertD,
+									const DisparityParams& params = DisparityParams(), cl::Event* event = nullptr, TemporalFrame* temporal = nullptr);
+
+/// Gives the images of a `ClUtils::TemporalState` back to the image pool of the context and empties it.
+/// \param clCtx The OpenCL context to use.
+/// \param state The state to release.
+void			releaseTemporalState(const cl::Context& clCtx, TemporalState& state);
+
+/// Runs the cross-check kernel on a left-to-right and a right-to-left disparity map. Pixels where the two
+/// maps differ more than `DisparityParams::crossTh` are zeroed.
+/// \param clCtx The OpenCL context to use.
+/// \param queue The OpenCL command queue to use.
+/// \param leftDisp The left-to-right disparity map.
+/// \param rightDisp The right-to-left disparity map.
+/// \param width The width of the disparity maps.
+/// \param height The height of the disparity maps.
+/// \param params The algorithm parameters to build the kernel with.
+/// \param waitEvents The events producing the disparity maps. Can be `nullptr`.
+/// \param event Outputs the event completing when the result is computed. Can be `nullptr`.
+/// \return The cross-checked disparity map.
+cl::Image2D		crossCheck(const cl::Context& clCtx, const cl::CommandQueue& queue, const cl::Image2D& leftDisp, const cl::Image2D& rightDisp,
+							unsigned width, unsigned height, const DisparityParams& params,
+							const std::vector<cl::Event>* waitEvents = nullptr, cl::Event* event = nullptr);
+
+/// Runs the occlusion fill kernel, which replaces the zeroed pixels of the cross-checked map with the nearest valid value.
+/// \param clCtx The OpenCL context to use.
+/// \param queue The OpenCL command queue to use.
+/// \param input The cross-checked disparity map.
+/// \param width The width of the disparity map.
+/// \param height The height of the disparity map.
+/// \param params The algorithm parameters to build the kernel with.
+/// \param waitEvents The events producing the input. Can be `nullptr`.
+/// \param event Outputs the event completing when the result is computed. Can be `nullptr`.
+/// \return The filled disparity map.
+cl::Image2D		fillOcclusions(const cl::Context& clCtx, const cl::CommandQueue& queue, const cl::Image2D& input,
+								unsigned width, unsigned height, const DisparityParams& params,
+								const std::vector<cl::Event>* waitEvents = nullptr, cl::Event* event = nullptr);
+
+/// Reads a single channel 8 bit image back to the host. Blocks until the data arrives.
+/// \param queue The OpenCL command queue to use.
+/// \param image The image to read.
+/// \param width The width of the image.
+/// \param height The height of the image.
+/// \param waitEvents The events producing the image. Can be `nullptr`.
+/// \return The pixel data.
+std::vector<uint8_t>	readGrayImage(const cl::CommandQueue& queue, const cl::Image2D& image, unsigned width, unsigned height,
+									const std::vector<cl::Event>* waitEvents = nullptr);
+
+/// Reads a single channel 8 bit image back to the host into an existing vector, reusing its capacity. In
+/// `TransferMode::ZeroCopy` the pixels are copied out of a mapping of the image. Blocks until the data arrives.
+/// \param queue The OpenCL command queue to use.
+/// \param image The image to read.
+/// \param width The width of the image.
+/// \param height The height of the image.
+/// \param pixels Outputs the pixel data.
+/// \param waitEvents The events producing the image. Can be `nullptr`.
+void		readGrayImage(const cl::CommandQueue& queue, const cl::Image2D& image, unsigned width, unsigned height,
+						std::vector<uint8_t>& pixels, const std::vector<cl::Event>* waitEvents = nullptr);
+
+/// Encodes a single channel 8 bit image to a png file. In `TransferMode::ZeroCopy` the encoder reads a mapping
+/// of the image, otherwise the image is read back to the host first. Blocks until the file is written.
+/// \param queue The OpenCL command queue to use.
+/// \param image The image to save.
+/// \param width The width of the image.
+/// \param height The height of the image.
+/// \param filename The path of the png file to write.
+/// \param waitEvents The events producing the image. Can be `nullptr`.
+void		saveGrayImage(const cl::CommandQueue& queue, const cl::Image2D& image, unsigned width, unsigned height,
+						const char* filename, const std::vector<cl::Event>* waitEvents = nullptr);
+
+/// Runs the whole disparity pipeline on an image pair. The left precalc chain and the left-to-right pass run
+/// on one queue, the right precalc chain and the right-to-left pass on the other, so devices with spare
+/// compute units run them concurrently. Cross-check and occlusion fill run on the left queue.
+/// \param clCtx The OpenCL context to use.
+/// \param leftQueue The OpenCL command queue of the left chain.
+/// \param rightQueue The OpenCL command queue of the right chain. Can be the same as `leftQueue`.
+/// \param pixelsL The RGBA pixel data of the left image.
+/// \param pixelsR The RGBA pixel data of the right image.
+/// \param width The width of the input images.
+/// \param height The height of the input images.
+/// \param params The algorithm parameters to build the kernels with. With `DisparityParams::pyramidLevels` set the
+/// coarse-to-fine search of `computePyramidDisparity` runs instead, producing a full resolution map.
+/// \return The final disparity map. Its `ready` event completes when it is computed. Release its image
+/// with `releaseImage` once it has been read. The intermediate images are released internally.
+DisparityResult	computeDisparity(const cl::Context& clCtx, const cl::CommandQueue& leftQueue, const cl::CommandQueue& rightQueue,
+								std::vector<uint8_t>& pixelsL, std::vector<uint8_t>& pixelsR, unsigned width, unsigned height,
+								const DisparityParams& params);
+
+/// Runs the disparity passes, the cross-check and the occlusion fill on a pair of precalculated images,
+/// queued like in the other overload. The precalculated images are released to the image pool.
+/// \param clCtx The OpenCL context to use.
+/// \param leftQueue The OpenCL command queue of the left-to-right pass.
+/// \param rightQueue The OpenCL command queue of the right-to-left pass. Can be the same as `leftQueue`.
+/// \param left The precalculated left image.
+/// \param right The precalculated right image.
+/// \param params The algorithm parameters to build the kernels with.
+/// \param temporal The state of the video the pair belongs to when `DisparityParams::temporalRange` is set. Can be `nullptr`.
+/// \return The final disparity map. Its `ready` event completes when it is computed.
+DisparityResult	computeDisparity(const cl::Context& clCtx, const cl::CommandQueue& leftQueue, const cl::CommandQueue& rightQueue,
+								const PrecalcImage& left, const PrecalcImage& right, const DisparityParams& params,
+								TemporalState* temporal = nullptr);
+
+/// Computes the disparity map of a pair with the given reduced precision parameters and with float storage, and
+/// logs how far the two maps are apart: the mean absolute difference and the share of pixels more than one
+/// disparity apart.
+/// \param clCtx The OpenCL context to use.
+/// \param leftQueue The OpenCL command queue of the left chain.
+/// \param rightQueue The OpenCL command queue of the right chain.
+/// \param pixelsL The RGBA pixel data of the left image.
+/// \param pixelsR The RGBA pixel data of the right image.
+/// \param width The width of the input images.
+/// \param height The height of the input images.
+/// \param params The algorithm parameters with `DisparityParams::storage` set to `StoragePrecision::Half`, not yet
+/// fitted: both runs are fitted to the device of the context separately, since the local memory use depends on the storage.
+void		logPrecisionDifference(const cl::Context& clCtx, const cl::CommandQueue& leftQueue, const cl::CommandQueue& rightQueue,
+									std::vector<uint8_t>& pixelsL, std::vector<uint8_t>& pixelsR, unsigned width, unsigned height,
+									const DisparityParams& params);
 
 }	// namespace ClUtils
 
@@ -0,0 +1,81 @@
+#ifndef DEVICECAPS_HPP
+#define DEVICECAPS_HPP
+
+#include <string>
+#include <vector>
+#include "CL/cl.hpp"
+
+
+namespace ClUtils {
+
+/// The capabilities of an OpenCL device which matter for choosing the device, the kernel variants
+/// and the work-group sizes.
+struct DeviceCaps {
+	cl::Device		device;
+	unsigned		platformIndex;
+	unsigned		deviceIndex;
+	std::string		platformName;
+	std::string		name;
+	cl_device_type	type;
+	unsigned		computeUnits;
+	unsigned		clockMhz;
+	cl_ulong		localMemSize;
+	bool			dedicatedLocalMem;	///< `CL_DEVICE_LOCAL_MEM_TYPE` is `CL_LOCAL`, not emulated in global memory.
+	bool			imageSupport;
+	cl_ulong		maxAllocSize;
+	cl_ulong		globalMemSize;
+	size_t			maxWorkGroupSize;
+	bool			hostUnifiedMemory;
+	bool			halfImages;			///< `CL_R` and `CL_RG` images with `CL_HALF_FLOAT` channels are supported. Only known for the device of a context.
+	unsigned		preferredFloatVectorWidth;
+	std::string		extensions;
+
+	/// \return `true` if the device is a CPU device, like PoCL or the Intel CPU runtime.
+	bool	isCpu() const;
+
+	/// \param extension The name of the extension, e.g. `cl_khr_fp16`.
+	/// \return `true` if the device supports the extension.
+	bool	hasExtension(const char* extension) const;
+};
+
+/// Queries the capabilities of every device of every platform.
+/// \return The capabilities of all devices.
+std::vector<DeviceCaps>	enumerateDevices();
+
+/// Rates how well the device suits the disparity pipeline. Devices without image support get zero,
+/// the others are rated by compute throughput (compute units, clock and SIMD width), local memory
+/// and the largest allowed allocation.
+/// \param caps The capabilities of the device.
+/// \return The score of the device, higher is better.
+double		scoreDevice(const DeviceCaps& caps);
+
+/// Selects the best scoring device. The selection can be overridden by the `DISPARITY_CL_DEVICE`
+/// environment variable or the argument, which can be `cpu`, `gpu`, `accelerator`, a
+/// `<platform index>:<device index>` pair or a part of the device name. The argument takes precedence.
+/// \param deviceOverride The device to use instead of the best scoring one. Empty for no override.
+/// \return The capabilities of the selected device.
+DeviceCaps	selectDevice(const std::string& deviceOverride = "");
+
+/// Returns the devices matching an override like `selectDevice` takes it, for running on several devices at once.
+/// \param deviceOverride The devices to use, see `selectDevice`. Empty for the `DISPARITY_CL_DEVICE` environment
+/// variable, or all devices without it. An override matching no device also gives all devices.
+/// \return The capabilities of the matching devices.
+std::vector<DeviceCaps>	matchingDevices(const std::string& deviceOverride = "");
+
+/// Returns the capabilities of the first device of the context. The result is cached per context.
+/// \param clCtx The OpenCL context to use.
+/// \return The device capabilities.
+const DeviceCaps&	deviceCaps(const cl::Context& clCtx);
+
+/// Drops the cached capabilities of the context, before the context goes away and a new one can get its handle.
+/// References returned by `deviceCaps` for it become invalid.
+/// \param clCtx The OpenCL context whose capabilities to drop.
+void		releaseDeviceCaps(const cl::Context& clCtx);
+
+/// Logs the capabilities of the device.
+/// \param caps The device capabilities to log.
+void		logDeviceCaps(const DeviceCaps& caps);
+
+}	// namespace ClUtils
+
+#endif
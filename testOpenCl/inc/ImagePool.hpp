@@ -0,0 +1,126 @@
+#ifndef IMAGEPOOL_HPP
+#define IMAGEPOOL_HPP
+
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <vector>
+#include "CL/cl.hpp"
+
+
+namespace ClUtils {
+
+/// Recycles the OpenCL images of one context by format and size, and its scratch buffers by size, so processing
+/// a series of same-sized frames allocates device memory only for the first one. A released image is handed out
+/// again only after the commands using it have completed, so recycling never adds host or device waits. The
+/// released images and buffers are kept up to a size limit, beyond it the ones released longest ago are freed,
+/// so a series of differently sized frames does not pile up the memory of every size.
+class ImagePool {
+public:
+	/// Returns the pool owned by the given context. The pool is created on first use.
+	/// \param clCtx The OpenCL context to use.
+	/// \return The image pool of the context.
+	static ImagePool&	forContext(const cl::Context& clCtx);
+
+	/// Drops the pool of the given context with its images. The pool holds references to the context, so the
+	/// context is only freed once its owner is done with it and has called this.
+	/// \param clCtx The OpenCL context whose pool to drop.
+	static void			release(const cl::Context& clCtx);
+
+	/// Returns a released image of the given format and size whose last users have completed,
+	/// or allocates a new one if there is none.
+	/// \param flags The memory flags of the image.
+	/// \param format The image format.
+	/// \param width The width of the image in pixels.
+	/// \param height The height of the image in pixels.
+	/// \return The OpenCL image handle object.
+	cl::Image2D		acquire(cl_mem_flags flags, const cl::ImageFormat& format, unsigned width, unsigned height);
+
+	/// Gives the image back to the pool. It can be acquired again once all of the events have completed.
+	/// \param image The image acquired from this pool.
+	/// \param lastUses The events of the last commands using the image.
+	void			release(const cl::Image2D& image, const std::vector<cl::Event>& lastUses);
+
+	/// Returns a released buffer of the given size whose last users have completed, or allocates a new one if
+	/// there is none.
+	/// \param flags The memory flags of the buffer.
+	/// \param bytes The size of the buffer in bytes.
+	/// \return The OpenCL buffer handle object.
+	cl::Buffer		acquireBuffer(cl_mem_flags flags, size_t bytes);
+
+	/// Gives the buffer back to the pool. It can be acquired again once all of the events have completed.
+	/// \param buffer The buffer acquired from this pool.
+	/// \param lastUses The events of the last commands using the buffer.
+	void			release(const cl::Buffer& buffer, const std::vector<cl::Event>& lastUses);
+
+	/// Sets the largest size of the released images and buffers the pool keeps for reuse, 256 MiB by default.
+	/// Trims the released memory to it.
+	/// \param bytes The size limit in bytes.
+	void			setFreeBytesLimit(size_t bytes);
+
+	/// \return The size of the images and buffers currently acquired and not yet released.
+	size_t			currentBytes() const;
+
+	/// \return The largest value `currentBytes` ever had.
+	size_t			peakBytes() const;
+
+	/// \return The size of all images and buffers held by the pool, whether in use or released.
+	size_t			pooledBytes() const;
+
+	/// \return The number of device allocations made by the pool.
+	unsigned		allocations() const;
+
+	/// Logs the allocation statistics of the pool.
+	void			logStats() const;
+
+private:
+	explicit ImagePool(const cl::Context& clCtx);
+
+	/// The memory flags, image format and size of an image, or the memory flags and the size in bytes of a buffer.
+	typedef std::tuple<cl_mem_flags, cl_channel_order, cl_channel_type, size_t, size_t>	Key;
+
+	struct Entry {
+		Key						key;
+		size_t					bytes;
+		bool					inUse;
+		unsigned long long		releaseOrder;	///< The value of `m_releases` when it was last released.
+		std::vector<cl::Event>	lastUses;
+	};
+
+	/// Takes a released image or buffer of the key whose last users have completed out of `free`.
+	/// \param free The released images or buffers.
+	/// \param key The key of the wanted memory object.
+	/// \param memory Receives the memory object.
+	/// \return Whether there was one.
+	template <typename Memory>
+	bool			reuse(std::multimap<Key, Memory>& free, const Key& key, Memory& memory);
+
+	/// Records a new allocation in use.
+	void			allocated(cl_mem memory, const Key& key, size_t bytes);
+
+	/// Puts an image or buffer acquired from this pool into `free`, and trims the released memory.
+	template <typename Memory>
+	void			putBack(std::multimap<Key, Memory>& free, const Memory& memory, const std::vector<cl::Event>& lastUses);
+
+	/// Frees the memory released longest ago until the released memory fits `m_freeBytesLimit`. Its last
+	/// users keep it alive on the device until they complete.
+	void			trim();
+
+	cl::Context						m_context;
+	std::map<cl_mem, Entry>			m_entries;
+	std::multimap<Key, cl::Image2D>	m_freeImages;
+	std::multimap<Key, cl::Buffer>	m_freeBuffers;
+	size_t							m_currentBytes;
+	size_t							m_peakBytes;
+	size_t							m_pooledBytes;
+	size_t							m_freeBytes;
+	size_t							m_freeBytesLimit;
+	unsigned long long				m_releases;
+	unsigned						m_allocations;
+	unsigned						m_reuses;
+	mutable std::mutex				m_mutex;
+};
+
+}	// namespace ClUtils
+
+#endif
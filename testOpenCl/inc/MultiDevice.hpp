@@ -0,0 +1,66 @@
+#ifndef MULTIDEVICE_HPP
+#define MULTIDEVICE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "CL/cl.hpp"
+#include "ClUtils.hpp"
+#include "DeviceCaps.hpp"
+
+
+namespace ClUtils {
+
+/// Runs the disparity pipeline on several devices at once. Every image pair is split into horizontal
+/// bands, one per device, which are computed with the halo rows the window kernels need, then stitched.
+/// The band heights follow the throughput measured on the previous pairs.
+class MultiDeviceExecutor {
+public:
+	/// Creates a context and a queue for every device. CPU devices which can be partitioned by NUMA
+	/// node are split into sub-devices, each of them getting its own band.
+	/// \param devices The devices to use.
+	/// \param params The algorithm parameters. The work-group size is fitted to every device separately, the downscale
+	/// factor is rounded to a whole number so every band starts on an input row.
+	/// \param splitNuma Whether to partition CPU devices by NUMA node.
+	MultiDeviceExecutor(const std::vector<DeviceCaps>& devices, const DisparityParams& params, bool splitNuma = true);
+
+	/// Drops the program caches, image pools and cached capabilities of the contexts it created.
+	~MultiDeviceExecutor();
+
+	/// Computes the final, cross-checked and occlusion filled disparity map of an image pair.
+	/// \param pixelsL The RGBA pixel data of the left image.
+	/// \param pixelsR The RGBA pixel data of the right image.
+	/// \param width The width of the input images.
+	/// \param height The height of the input images.
+	/// \param outWidth Outputs the width of the disparity map.
+	/// \param outHeight Outputs the height of the disparity map.
+	/// \return The disparity map pixel data.
+	std::vector<uint8_t>	computeDisparity(const std::vector<uint8_t>& pixelsL, const std::vector<uint8_t>& pixelsR, unsigned width, unsigned height,
+											unsigned& outWidth, unsigned& outHeight);
+
+	/// Logs the measured throughput and the current band share of every device.
+	void		logBalance() const;
+
+	/// \return The number of devices and sub-devices the bands are distributed to.
+	size_t		workerCount() const;
+
+private:
+	struct Worker {
+		std::string			name;
+		cl::Context			context;
+		cl::CommandQueue	queue;
+		DisparityParams		params;
+		double				rowsPerSecond;	///< Measured throughput, zero until the first pair.
+		double				share;			///< The fraction of the rows assigned to the device.
+	};
+
+	void		rebalance(const std::vector<unsigned>& rows, const std::vector<double>& seconds);
+
+	std::vector<Worker>					m_workers;
+	DisparityParams						m_params;
+	std::vector<std::vector<uint8_t>>	m_bandPixels;	///< Host copies of the input bands, reused between pairs.
+};
+
+}	// namespace ClUtils
+
+#endif
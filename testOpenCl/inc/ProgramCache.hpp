@@ -0,0 +1,87 @@
+#ifndef PROGRAMCACHE_HPP
+#define PROGRAMCACHE_HPP
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include "CL/cl.hpp"
+
+
+namespace ClUtils {
+
+/// Registry of the built OpenCL programs and kernels of one context. Every program is built only once
+/// per source file and build option set, and every kernel is created only once per program.
+/// Built program binaries are also persisted in a cache directory, so later runs on the same device
+/// and driver skip the compilation from source.
+class ProgramCache {
+public:
+	/// Returns the cache owned by the given context. The cache is created on first use.
+	/// \param clCtx The OpenCL context to use.
+	/// \return The program cache of the context.
+	static ProgramCache&	forContext(const cl::Context& clCtx);
+
+	/// Drops the cache of the given context with its programs and kernels. The cache holds references to the
+	/// context, so the context is only freed once its owner is done with it and has called this.
+	/// \param clCtx The OpenCL context whose cache to drop.
+	static void		release(const cl::Context& clCtx);
+
+	/// Returns the ready kernel, building its program if it is not in the cache yet. The returned kernel
+	/// is shared by every caller, so it must not be used from several threads at once.
+	/// \param filename The path of the .cl file.
+	/// \param kernelname The name of the kernel function.
+	/// \param options The build options passed to the OpenCL compiler.
+	/// \return The cached kernel.
+	cl::Kernel		kernel(const char* filename, const char* kernelname, const std::string& options = "");
+
+	/// Creates a new kernel object from the cached program, for use in parallel with the shared one.
+	/// \param filename The path of the .cl file.
+	/// \param kernelname The name of the kernel function.
+	/// \param options The build options passed to the OpenCL compiler.
+	/// \return The new kernel object.
+	cl::Kernel		cloneKernel(const char* filename, const char* kernelname, const std::string& options = "");
+
+	/// Sets the directory of the persistent program binary cache. The default is the value of the
+	/// `DISPARITY_CL_CACHE` environment variable, or `clcache` when it is not set.
+	/// \param directory The cache directory. An empty string disables the binary cache.
+	static void		setBinaryCacheDirectory(const std::string& directory);
+
+	/// \return The number of kernel requests served from the cached kernels.
+	unsigned		hits() const;
+
+	/// \return The number of kernel requests which created a kernel, with or without building its program.
+	unsigned		misses() const;
+
+	/// \return The number of programs built or loaded from the persistent binary cache.
+	unsigned		builds() const;
+
+	/// \return The number of program builds served from the persistent binary cache.
+	unsigned		binaryHits() const;
+
+	/// Logs the hit and miss counts of the cache.
+	void			logStats() const;
+
+private:
+	explicit ProgramCache(const cl::Context& clCtx);
+
+	cl::Program		program(const std::string& filename, const std::string& options);
+	std::string		binaryPath(const std::string& source, const std::string& options) const;
+	bool			loadBinary(const std::string& path, const std::string& options, cl::Program& program) const;
+	void			storeBinary(const std::string& path, const cl::Program& program) const;
+
+	typedef std::pair<std::string, std::string>					ProgramKey;
+	typedef std::tuple<std::string, std::string, std::string>	KernelKey;
+
+	cl::Context							m_context;
+	std::map<ProgramKey, cl::Program>	m_programs;
+	std::map<KernelKey, cl::Kernel>		m_kernels;
+	unsigned							m_hits;
+	unsigned							m_misses;
+	unsigned							m_builds;
+	unsigned							m_binaryHits;
+	mutable std::mutex					m_mutex;
+};
+
+}	// namespace ClUtils
+
+#endif
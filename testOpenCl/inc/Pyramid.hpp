@@ -0,0 +1,57 @@
+#ifndef PYRAMID_HPP
+#define PYRAMID_HPP
+
+#include <cstdint>
+#include <vector>
+#include "CL/cl.hpp"
+#include "ClUtils.hpp"
+
+
+namespace ClUtils {
+
+/// Builds the gray image pyramid of an RGBA image. Level 0 is the full resolution, every further level halves
+/// the previous one with a 2x2 box filter. Every level holds its window means and standard deviations.
+/// \param clCtx The OpenCL context to use.
+/// \param queue The OpenCL command queue to use.
+/// \param input The RGBA input image with `CL_UNSIGNED_INT8` channels.
+/// \param width The width of the input image.
+/// \param height The height of the input image.
+/// \param params The algorithm parameters, `DisparityParams::pyramidLevels` gives the number of levels.
+/// \param waitEvents The events producing the input image. Can be `nullptr`.
+/// \return The levels from the finest to the coarsest.
+std::vector<PrecalcImage>	precalcPyramid(const cl::Context& clCtx, const cl::CommandQueue& queue, const cl::Image2D& input,
+											unsigned width, unsigned height, const DisparityParams& params,
+											const std::vector<cl::Event>* waitEvents);
+
+/// Computes a full resolution disparity map coarse to fine: the full `DisparityParams::maxDisp` range is only
+/// searched at the coarsest level, every finer level searches `DisparityParams::refineRange` pixels around the
+/// doubled disparity of the level below. The result is scaled like the map of `calculateDisparityMap`, by the
+/// full resolution range `maxDisp << (pyramidLevels - 1)`.
+/// \param clCtx The OpenCL context to use.
+/// \param queue The OpenCL command queue to use.
+/// \param left The pyramid of the left image.
+/// \param right The pyramid of the right image.
+/// \param invertD When the left and right image are mixed up for post-processing purposes, this has to be set `true`.
+/// \param params The algorithm parameters to build the kernels with.
+/// \param event Outputs the event completing when the disparity map is computed. Can be `nullptr`.
+/// \return The full resolution disparity map.
+cl::Image2D		pyramidDisparityMap(const cl::Context& clCtx, const cl::CommandQueue& queue, const std::vector<PrecalcImage>& left,
+									const std::vector<PrecalcImage>& right, bool invertD, const DisparityParams& params, cl::Event* event = nullptr);
+
+/// Runs the whole pipeline of `computeDisparity` with the coarse-to-fine search, producing a full resolution map.
+/// \param clCtx The OpenCL context to use.
+/// \param leftQueue The OpenCL command queue of the left chain.
+/// \param rightQueue The OpenCL command queue of the right chain. Can be the same as `leftQueue`.
+/// \param pixelsL The RGBA pixel data of the left image.
+/// \param pixelsR The RGBA pixel data of the right image.
+/// \param width The width of the input images.
+/// \param height The height of the input images.
+/// \param params The algorithm parameters to build the kernels with.
+/// \return The final disparity map. Its `ready` event completes when it is computed.
+DisparityResult	computePyramidDisparity(const cl::Context& clCtx, const cl::CommandQueue& leftQueue, const cl::CommandQueue& rightQueue,
+										std::vector<uint8_t>& pixelsL, std::vector<uint8_t>& pixelsR, unsigned width, unsigned height,
+										const DisparityParams& params);
+
+}	// namespace ClUtils
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef STREAMENGINE_HPP
+#define STREAMENGINE_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include "CL/cl.hpp"
+#include "ClUtils.hpp"
+
+
+namespace ClUtils {
+
+/// Computes the disparity maps of a stereo video stream with several frames in flight. Every frame uses one slot
+/// of a ring holding its host buffers, the device images come from the `ClUtils::ImagePool` of the context. Uploads
+/// go to an upload queue in the `ClUtils::TransferMode` of the context, the kernels to two compute queues and the
+/// readbacks to a transfer queue, all linked only by events, so frame N+1 can upload while frame N computes and frame N-1
+/// reads back. The throughput is then bounded by the slowest stage instead of the sum of the stages. With
+/// `DisparityParams::temporalRange` set, every frame narrows the disparity search of the next one.
+class StreamEngine {
+public:
+	/// \param clCtx The OpenCL context to use.
+	/// \param params The algorithm parameters, fitted to the device of the context.
+	/// \param depth The number of frames in flight: 2 for double, 3 for triple buffering.
+	StreamEngine(const cl::Context& clCtx, const DisparityParams& params, unsigned depth = 3);
+
+	/// Waits for the frames in flight, which are then dropped.
+	~StreamEngine();
+
+	/// Enqueues the upload and the computation of a frame, without waiting for the device. Must not be called from
+	/// several threads at once, `popResult` can be called from another thread though. Blocks only while every
+	/// slot holds a frame which was not popped yet. The pixel buffers are swapped with the buffers of the slot, so
+	/// nothing is copied and the caller gets back the buffers of an older frame to decode the next one into.
+	/// \param pixelsL The RGBA pixel data of the left image.
+	/// \param pixelsR The RGBA pixel data of the right image.
+	/// \param width The width of the input images.
+	/// \param height The height of the input images.
+	void		pushFrame(std::vector<uint8_t>& pixelsL, std::vector<uint8_t>& pixelsR, unsigned width, unsigned height);
+
+	/// Waits for the oldest frame in flight to be read back and hands over its disparity map. The buffer is swapped
+	/// with the one given, which is reused for a later frame. A frame whose commands failed is popped all the same,
+	/// its map is not handed over.
+	/// \param disparity Outputs the disparity map pixel data. Left as is if the frame failed.
+	/// \param width Outputs the width of the disparity map.
+	/// \param height Outputs the height of the disparity map.
+	/// \param failed Outputs whether the frame or one of the commands it waited for failed on the device.
+	/// \return False if there is no frame in flight.
+	bool		popResult(std::vector<uint8_t>& disparity, unsigned& width, unsigned& height, bool& failed);
+
+	/// \return The number of frames pushed and not yet popped.
+	unsigned	framesInFlight() const;
+
+private:
+	/// The resources of one frame in flight.
+	struct Slot {
+		StreamEngine*			owner;
+		std::vector<uint8_t>	pixelsL;
+		std::vector<uint8_t>	pixelsR;
+		std::vector<uint8_t>	disparity;
+		unsigned				width;
+		unsigned				height;
+		unsigned				outWidth;
+		unsigned				outHeight;
+		bool					busy;		///< Pushed and not yet popped.
+		bool					readBack;	///< Set by the readback event callback.
+		bool					failed;		///< Set by the readback event callback for an error status.
+	};
+
+	static void CL_CALLBACK	onReadBack(cl_event, cl_int status, void* userData);
+
+	cl::Context				m_context;
+	cl::CommandQueue		m_uploadQueue;		///< Separate from the readbacks, so a blocking zero-copy map does not wait for them.
+	cl::CommandQueue		m_transferQueue;
+	cl::CommandQueue		m_leftQueue;
+	cl::CommandQueue		m_rightQueue;
+	DisparityParams			m_params;
+	TemporalState			m_temporal;		///< Used when `DisparityParams::temporalRange` is set.
+	std::vector<Slot>		m_slots;
+	unsigned				m_head;			///< The slot of the next pushed frame.
+	unsigned				m_tail;			///< The slot of the next popped frame.
+	unsigned				m_inFlight;
+	mutable std::mutex		m_mutex;
+	std::condition_variable	m_changed;
+};
+
+}	// namespace ClUtils
+
+#endif
@@ -0,0 +1,81 @@
+#include "clIncludes.h"
+
+// Summed-area tables of the gray image and of its square, giving the window sums of any window size in O(1).
+// The gray values are converted to fixed point with FIXED_BITS fraction bits, so the tables hold exact integers
+// and the window sums taken as differences of four entries have no cancellation error, however large the image.
+// The entries may wrap around, the differences stay exact as long as the window sums themselves fit in 64 bits.
+// The table covers the gray image padded by D pixels on every side with its edge pixels, like the clamping
+// samplers of mean.cl and std_dev.cl, plus a leading row and column of zeros: entry (x, y) is the sum of the
+// padded pixels left of column x and above row y.
+#define FIXED_BITS 12
+
+// the work-group width of the row scan, a power of two
+#ifndef SCAN_WIDTH
+#define SCAN_WIDTH 256
+#endif
+
+__constant const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+
+// row pass: every work-group scans one table row in chunks of SCAN_WIDTH entries in local memory
+__kernel void integralRows(__read_only image2d_t gray, __global ulong2* table, int tableWidth) {
+	const int lx = get_local_id(0);
+	const int y = get_group_id(1);
+	__global ulong2* row = table + (size_t)y * tableWidth;
+	__local ulong2 scan[SCAN_WIDTH];
+	ulong2 carry = (ulong2)(0, 0);
+	for (int chunk = 0; chunk < tableWidth; chunk += SCAN_WIDTH) {
+		const int x = chunk + lx;
+		ulong2 value = (ulong2)(0, 0);
+		if (x > 0 && y > 0 && x < tableWidth) {
+			// the sampler repeats the edge pixels in the padding
+			const ulong fixed = convert_ulong_rte(read_imagef(gray, sampler, (int2)(x - 1 - D, y - 1 - D)).x * (float)(1 << FIXED_BITS));
+			value = (ulong2)(fixed, fixed * fixed);
+		}
+		scan[lx] = value;
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		// inclusive Hillis-Steele scan of the chunk
+		for (int offset = 1; offset < SCAN_WIDTH; offset *= 2) {
+			const ulong2 add = lx >= offset ? scan[lx - offset] : (ulong2)(0, 0);
+			barrier(CLK_LOCAL_MEM_FENCE);
+			scan[lx] += add;
+			barrier(CLK_LOCAL_MEM_FENCE);
+		}
+
+		if (x < tableWidth) {
+			row[x] = carry + scan[lx];
+		}
+		carry += scan[SCAN_WIDTH - 1];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+
+// column pass: every work-item accumulates one column down the rows, neighbouring work-items access
+// neighbouring entries
+__kernel void integralColumns(__global ulong2* table, int tableWidth, int tableHeight) {
+	const int x = get_global_id(0);
+	ulong2 sum = (ulong2)(0, 0);
+	for (int y = 0; y < tableHeight; ++y) {
+		__global ulong2* entry = table + (size_t)y * tableWidth + x;
+		sum += *entry;
+		*entry = sum;
+	}
+}
+
+
+// window mean and standard deviation from four table entries each
+__kernel void integralStats(__global const ulong2* table, int tableWidth, __write_only image2d_t means, __write_only image2d_t stdDev) {
+	const int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	// the window of the pixel covers the padded rows and columns [coord, coord + WINDOW)
+	__global const ulong2* top = table + (size_t)coord.y * tableWidth + coord.x;
+	__global const ulong2* bottom = top + (size_t)WINDOW * tableWidth;
+	const ulong2 sums = bottom[WINDOW] - bottom[0] - top[WINDOW] + top[0];
+	const ulong n = WINDOW * WINDOW;
+	// n * the sum of the squared deviations from the mean, exact for windows up to 89 pixels wide
+	const ulong deviations = n * sums.y - sums.x * sums.x;
+	const float scale = (float)(1 << FIXED_BITS);
+	write_imagef(means, coord, (float)sums.x / ((float)n * scale));
+	write_imagef(stdDev, coord, sqrt((float)deviations / (float)n) / scale);
+}
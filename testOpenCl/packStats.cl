@@ -0,0 +1,7 @@
+#include "clIncludes.h"
+
+// packs the window means and standard deviations into the statistics image the disparity kernel reads
+__kernel void packStats(__read_only image2d_t means, __read_only image2d_t stdDev, __write_only image2d_t stats) {
+	const int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	write_imagef(stats, coord, packedStats(read_imagef(means, coord).x, read_imagef(stdDev, coord).x));
+}
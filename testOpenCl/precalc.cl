@@ -0,0 +1,71 @@
+#include "clIncludes.h"
+
+#define TILE_W (GW + 2 * D)
+#define TILE_H (GH + 2 * D)
+// the input rectangle under the footprints of the tile
+#define SRC_W ((int)(TILE_W * DOWNSCALE) + 3)
+#define SRC_H ((int)(TILE_H * DOWNSCALE) + 3)
+
+const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+// preprocess + mean + stdDev + packStats in one pass: every work-group loads the input rectangle under its
+// tile of the downscaled gray image (plus the window halo) into local memory like preprocess.cl, converts the
+// tile once from it, then every work-item computes its window sums from the tile
+__kernel void precalc(__read_only image2d_t input, __write_only image2d_t gray, __write_only image2d_t means, __write_only image2d_t stdDev,
+	__write_only image2d_t stats) {
+	const int cx = get_global_id(0);
+	const int cy = get_global_id(1);
+	const int gx = get_local_id(0);
+	const int gy = get_local_id(1);
+	const int width = get_image_width(gray);
+	const int height = get_image_height(gray);
+	const int tileX = get_group_id(0) * GW - D;
+	const int tileY = get_group_id(1) * GH - D;
+	// the tile is clamped to the edge of the downscaled image, like the samplers of mean.cl and std_dev.cl,
+	// so the input rectangle starts under the first gray pixel inside the image
+	const int srcX = (int)(clamp(tileX, 0, width - 1) * DOWNSCALE);
+	const int srcY = (int)(clamp(tileY, 0, height - 1) * DOWNSCALE);
+	__local float src[SRC_H][SRC_W];
+	for (int sy = gy; sy < SRC_H; sy += GH) {
+		for (int sx = gx; sx < SRC_W; sx += GW) {
+			src[sy][sx] = rgbaToGray(read_imageui(input, sampler, (int2)(srcX + sx, srcY + sy)));
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	__local float tile[TILE_H][TILE_W];
+	for (int ty = gy; ty < TILE_H; ty += GH) {
+		for (int tx = gx; tx < TILE_W; tx += GW) {
+			const int2 coord = clamp((int2)(tileX + tx, tileY + ty), (int2)(0, 0), (int2)(width - 1, height - 1));
+			tile[ty][tx] = areaGray(&src[0][0], SRC_W, srcX, srcY, coord);
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// the global range is padded to whole work-groups
+	if (cx >= width || cy >= height) {
+		return;
+	}
+
+	// sums of the samples shifted by the center value, which keeps the sum of squares small
+	// enough for float precision
+	const float center = tile[gy + D][gx + D];
+	float sum = 0.f;
+	float sumSq = 0.f;
+	for (int row = gy; row < gy + WINDOW; ++row) {
+		for (int col = gx; col < gx + WINDOW; ++col) {
+			const float value = tile[row][col] - center;
+			sum += value;
+			sumSq += value * value;
+		}
+	}
+	const int2 coord = (int2)(cx, cy);
+	write_imagef(gray, coord, center);
+	const float mean = center + sum / (float)(WINDOW * WINDOW);
+	const float deviation = sqrt(max(sumSq - sum * sum / (float)(WINDOW * WINDOW), 0.f));
+	write_imagef(means, coord, mean);
+	write_imagef(stdDev, coord, deviation);
+	write_imagef(stats, coord, packedStats(mean, deviation));
+}
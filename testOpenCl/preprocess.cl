@@ -1,10 +1,35 @@
-const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP | CLK_FILTER_NEAREST;
+#include "clIncludes.h"
 
-// convert to float grayscale
+const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+// the input rectangle under the footprints of a GW x GH tile of gray pixels
+#define SRC_W ((int)(GW * DOWNSCALE) + 3)
+#define SRC_H ((int)(GH * DOWNSCALE) + 3)
+
+// convert to float grayscale, downscaled by area averaging: every work-group loads the input rectangle under
+// its tile once into local memory, neighbouring work-items reading neighbouring RGBA pixels, then every
+// work-item averages its footprint from local memory
 __kernel void preprocess(__read_only image2d_t input, __write_only image2d_t output) {
-	int2 coord = (int2)(get_global_id(0), get_global_id(1));
-	int2 inputCoord = coord * 4;
-	float4 sample = convert_float4(read_imageui(input, sampler, inputCoord));
-	const float4 rgb2gray = { 0.2126f, 0.7152f, 0.0722f, 0.f };
-	write_imagef(output, coord, dot(rgb2gray, sample));
+	const int cx = get_global_id(0);
+	const int cy = get_global_id(1);
+	const int gx = get_local_id(0);
+	const int gy = get_local_id(1);
+	const int srcX = (int)(get_group_id(0) * GW * DOWNSCALE);
+	const int srcY = (int)(get_group_id(1) * GH * DOWNSCALE);
+
+	__local float src[SRC_H][SRC_W];
+	for (int ty = gy; ty < SRC_H; ty += GH) {
+		for (int tx = gx; tx < SRC_W; tx += GW) {
+			src[ty][tx] = rgbaToGray(read_imageui(input, sampler, (int2)(srcX + tx, srcY + ty)));
+		}
+	}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// the global range is padded to whole work-groups
+	if (cx >= get_image_width(output) || cy >= get_image_height(output)) {
+		return;
+	}
+
+	write_imagef(output, (int2)(cx, cy), areaGray(&src[0][0], SRC_W, srcX, srcY, (int2)(cx, cy)));
 }
@@ -0,0 +1,74 @@
+#include "clIncludes.h"
+
+__constant const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+#ifndef REFINE_RANGE
+#define REFINE_RANGE 2
+#endif
+
+
+inline float sample(__read_only image2d_t in, int col, int row) {
+	return read_imagef(in, sampler, (int2)(col, row)).x;
+}
+
+
+// full resolution grayscale, the finest level of the pyramid
+__kernel void toGray(__read_only image2d_t input, __write_only image2d_t output) {
+	const int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	const float4 rgb2gray = { 0.2126f, 0.7152f, 0.0722f, 0.f };
+	write_imagef(output, coord, dot(rgb2gray, convert_float4(read_imageui(input, sampler, coord))));
+}
+
+
+// the next coarser level: 2x2 box filter and decimation
+__kernel void pyrDown(__read_only image2d_t input, __write_only image2d_t output) {
+	const int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	const int2 src = coord * 2;
+	const float sum = read_imagef(input, sampler, src).x + read_imagef(input, sampler, src + (int2)(1, 0)).x
+		+ read_imagef(input, sampler, src + (int2)(0, 1)).x + read_imagef(input, sampler, src + (int2)(1, 1)).x;
+	write_imagef(output, coord, sum * 0.25f);
+}
+
+
+// ZNCC search in [2c - REFINE_RANGE, 2c + REFINE_RANGE] around the doubled disparity c of the coarser level
+__kernel void refineDisparity(
+	__write_only image2d_t output, __read_only image2d_t left, __read_only image2d_t right,
+	__read_only image2d_t leftMeans, __read_only image2d_t rightMeans,
+	__read_only image2d_t leftStd, __read_only image2d_t rightStd,
+	__read_only image2d_t coarse, int invertD, int maxDisp)
+{
+	const int cx = get_global_id(0);
+	const int cy = get_global_id(1);
+	const float meanL = sample(leftMeans, cx, cy);
+	const float stdL = sample(leftStd, cx, cy);
+	const int guess = 2 * (int)read_imageui(coarse, sampler, (int2)(cx / 2, cy / 2)).x;
+	const int firstDisp = max(guess - REFINE_RANGE, 0);
+	const int lastDisp = min(guess + REFINE_RANGE, maxDisp - 1);
+
+	float bestZncc = 0.f;
+	int bestDisp = min(guess, maxDisp - 1);
+	for (int disp = firstDisp; disp <= lastDisp; ++disp) {
+		const int d = invertD ? -disp : disp;
+		const float meanR = sample(rightMeans, cx - d, cy);
+		float sum = 0.f;
+		for (int row = cy - D; row <= cy + D; ++row) {
+			for (int col = cx - D; col <= cx + D; ++col) {
+				sum += (sample(left, col, row) - meanL) * (sample(right, col - d, row) - meanR);
+			}
+		}
+		const float zncc = sum / stdL / sample(rightStd, cx - d, cy);
+		if (zncc > bestZncc) {
+			bestZncc = zncc;
+			bestDisp = disp;
+		}
+	}
+	write_imageui(output, (int2)(cx, cy), bestDisp);
+}
+
+
+// the 8 bit map of the single scale search, scaled by the full resolution range
+__kernel void scaleDisparity(__write_only image2d_t output, __read_only image2d_t input, int maxDisp) {
+	const int2 coord = (int2)(get_global_id(0), get_global_id(1));
+	const uint disp = read_imageui(input, sampler, coord).x;
+	write_imageui(output, coord, convert_uchar_sat((float)disp / maxDisp * 255.f));
+}
@@ -0,0 +1,213 @@
+#include "BatchRunner.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include "BoundedQueue.hpp"
+#include "DeviceCaps.hpp"
+#include "Logger.hpp"
+#include "lodepng.h"
+
+
+namespace fs = std::filesystem;
+
+namespace {
+
+std::string defaultOutput(const fs::path& left, const std::string& outputDirectory) {
+	const fs::path directory = outputDirectory.empty() ? left.parent_path() : fs::path(outputDirectory);
+	return (directory / (left.stem().string() + "_disp.png")).string();
+}
+
+bool isPairDirectory(const fs::path& directory) {
+	return fs::is_regular_file(directory / "im0.png") && fs::is_regular_file(directory / "im1.png");
+}
+
+}
+
+
+std::vector<ClUtils::StereoPair> ClUtils::readPairManifest(const std::string& path, unsigned& failed, const std::string& outputDirectory) {
+	failed = 0;
+	std::ifstream manifest(path);
+	if (!manifest) {
+		std::cout << "cannot open pair manifest '" << path << "'" << std::endl;
+		failed = 1;
+		return {};
+	}
+	const fs::path base = fs::path(path).parent_path();
+	std::vector<StereoPair> pairs;
+	std::string line;
+	while (std::getline(manifest, line)) {
+		std::istringstream fields(line);
+		std::string left, right, output;
+		if (!(fields >> left) || left[0] == '#') {
+			continue;
+		}
+		if (!(fields >> right)) {
+			std::cout << "pair manifest line without a right image: " << line << std::endl;
+			++failed;
+			continue;
+		}
+		fields >> output;
+		const fs::path leftPath = base / left;
+		pairs.push_back({leftPath.string(), (base / right).string(),
+						output.empty() ? defaultOutput(leftPath, outputDirectory) : (base / output).string()});
+	}
+	return pairs;
+}
+
+
+std::vector<ClUtils::StereoPair> ClUtils::findPairs(const std::string& directory, unsigned& failed, const std::string& outputDirectory) {
+	failed = 0;
+	std::vector<fs::path> pairDirectories;
+	if (isPairDirectory(directory)) {
+		pairDirectories.push_back(directory);
+	}
+	std::error_code error;
+	for (const auto& entry : fs::directory_iterator(directory, error)) {
+		if (entry.is_directory() && isPairDirectory(entry.path())) {
+			pairDirectories.push_back(entry.path());
+		}
+	}
+	if (error) {
+		std::cout << "cannot list directory '" << directory << "': " << error.message() << std::endl;
+		failed = 1;
+		return {};
+	}
+	std::sort(pairDirectories.begin(), pairDirectories.end());
+
+	std::vector<StereoPair> pairs;
+	for (const auto& pairDirectory : pairDirectories) {
+		const auto output = outputDirectory.empty() ? pairDirectory / "disp.png"
+			: fs::path(outputDirectory) / (fs::absolute(pairDirectory).filename().string() + ".png");
+		pairs.push_back({(pairDirectory / "im0.png").string(), (pairDirectory / "im1.png").string(), output.string()});
+	}
+	return pairs;
+}
+
+
+ClUtils::BatchRunner::BatchRunner(const cl::Context& clCtx, const DisparityParams& params, unsigned framesInFlight)
+	: m_context(clCtx), m_leftQueue(createQueue(clCtx)), m_rightQueue(createQueue(clCtx)), m_readQueue(createQueue(clCtx)), m_params(params.fitToDevice(deviceCaps(clCtx))),
+	m_framesInFlight(std::max(framesInFlight, 1u)), m_pairs(0), m_failed(0), m_seconds(0.0), m_firstPairSeconds(0.0) {
+}
+
+
+unsigned ClUtils::BatchRunner::run(const std::vector<StereoPair>& pairs) {
+	std::vector<Frame> frames(m_framesInFlight);
+	BoundedQueue<Frame*> freeFrames(m_framesInFlight), decoded(m_framesInFlight), submitted(m_framesInFlight), readBack(m_framesInFlight);
+	for (auto& frame : frames) {
+		freeFrames.push(&frame);
+	}
+	m_pairs = 0;
+	m_failed = 0;
+	m_firstPairSeconds = 0.0;
+	const auto start = Clock::now();
+
+	std::thread decodeThread([&]() {
+		for (const auto& pair : pairs) {
+			Frame* frame;
+			freeFrames.pop(frame);
+			frame->pair = &pair;
+			unsigned widthR, heightR;
+			// the decoder appends to the vectors
+			frame->pixelsL.clear();
+			frame->pixelsR.clear();
+			unsigned error = lodepng::decode(frame->pixelsL, frame->width, frame->height, pair.left, LCT_RGBA);
+			if (error) {
+				Logger::logLoad(error, pair.left.c_str());
+			} else if ((error = lodepng::decode(frame->pixelsR, widthR, heightR, pair.right, LCT_RGBA))) {
+				Logger::logLoad(error, pair.right.c_str());
+			} else if (frame->width != widthR || frame->height != heightR) {
+				std::cout << "input image dimensions should match: " << pair.left << std::endl;
+				error = 1;
+			}
+			frame->ok = error == 0;
+			decoded.push(frame);
+		}
+		decoded.close();
+	});
+
+	// an OpenCL error fails the pair it happened on, it is logged where it happened
+	std::thread submitThread([&]() {
+		ThrowOnError throwOnError;
+		Frame* frame;
+		while (decoded.pop(frame)) {
+			if (frame->ok) {
+				try {
+					auto result = computeDisparity(m_context, m_leftQueue, m_rightQueue, frame->pixelsL, frame->pixelsR,
+													frame->width, frame->height, m_params);
+					frame->outWidth = result.width;
+					frame->outHeight = result.height;
+					frame->image = result.image;
+					frame->ready = result.ready;
+				} catch (const ClError& error) {
+					std::cout << "pair failed on the device (" << error.what() << "): " << frame->pair->left << std::endl;
+					frame->ok = false;
+				}
+			}
+			submitted.push(frame);
+		}
+		submitted.close();
+	});
+
+	// reads back on its own queue, so a read does not wait behind the later pairs the submit thread enqueues
+	std::thread readbackThread([&]() {
+		ThrowOnError throwOnError;
+		Frame* frame;
+		while (submitted.pop(frame)) {
+			if (frame->ok) {
+				try {
+					const std::vector<cl::Event> waitEvents{frame->ready};
+					readGrayImage(m_readQueue, frame->image, frame->outWidth, frame->outHeight, frame->disparity, &waitEvents);
+				} catch (const ClError& error) {
+					std::cout << "pair failed on the device (" << error.what() << "): " << frame->pair->left << std::endl;
+					frame->ok = false;
+				}
+				releaseImage(m_context, frame->image, {});
+			}
+			readBack.push(frame);
+		}
+		readBack.close();
+	});
+
+	// the encoder runs on this thread and hands the frames back to the decoder
+	Frame* frame;
+	while (readBack.pop(frame)) {
+		if (frame->ok) {
+			const unsigned error = lodepng::encode(frame->pair->output, frame->disparity, frame->outWidth, frame->outHeight, LCT_GREY, 8);
+			if (error) {
+				Logger::logSave(error, frame->pair->output.c_str());
+				frame->ok = false;
+			}
+		}
+		if (!frame->ok) {
+			++m_failed;
+		}
+		if (++m_pairs == 1) {
+			m_firstPairSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+		}
+		freeFrames.push(frame);
+	}
+
+	decodeThread.join();
+	submitThread.join();
+	readbackThread.join();
+	m_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	return m_failed;
+}
+
+
+void ClUtils::BatchRunner::logStats() const {
+	std::cout << "batch: " << m_pairs << " pairs, " << m_failed << " failed, in " << m_seconds << "s with "
+		<< m_framesInFlight << " frames in flight" << std::endl;
+	if (m_seconds > 0.0) {
+		std::cout << "batch: " << m_pairs / m_seconds << " pairs/s overall";
+		// the first pair pays for the program builds and the pool allocations
+		if (m_pairs > 1 && m_seconds > m_firstPairSeconds) {
+			std::cout << ", " << (m_pairs - 1) / (m_seconds - m_firstPairSeconds) << " pairs/s sustained";
+		}
+		std::cout << std::endl;
+	}
+}
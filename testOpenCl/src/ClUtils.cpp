@@ -1,41 +1,224 @@
 #include "ClUtils.hpp"
 
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <streambuf>
+#include <utility>
+#include "DeviceCaps.hpp"
+#include "ImagePool.hpp"
 #include "Logger.hpp"
+#include "ProgramCache.hpp"
+#include "Pyramid.hpp"
 #include "lodepng.h"
-#include "clIncludes.h"
-
-
-cl::Context ClUtils::initCl() {
-	//get all platforms (drivers)
-    std::vector<cl::Platform> all_platforms;
-    cl::Platform::get(&all_platforms);
-    if(all_platforms.size()==0){
-        std::cout<<" No platforms found. Check OpenCL installation!" << std::endl;
-        exit(1);
-    }
-    cl::Platform default_platform=all_platforms[1];
-    std::cout << "Using platform: "<<default_platform.getInfo<CL_PLATFORM_NAME>()<<std::endl;
-
-    //get default device of the default platform
-    std::vector<cl::Device> all_devices;
-    default_platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
-    if(all_devices.size()==0){
-        std::cout<<" No devices found. Check OpenCL installation!" << std::endl;
-        exit(1);
-    }
-    cl::Device default_device=all_devices[0];
-    std::cout<< "Using device: "<<default_device.getInfo<CL_DEVICE_NAME>()<<std::endl;
-	std::cout << "CL_DEVICE_LOCAL_MEM_TYPE: " << default_device.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>() << std::endl;
-	std::cout << "CL_DEVICE_LOCAL_MEM_SIZE: " << default_device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() << std::endl;
-	std::cout << "CL_DEVICE_MAX_COMPUTE_UNITS: " << default_device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() << std::endl;
-	std::cout << "CL_DEVICE_MAX_CLOCK_FREQUENCY: " << default_device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>() << std::endl;
-	std::cout << "CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE: " << default_device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>() << std::endl;
-	std::cout << "CL_DEVICE_MAX_WORK_GROUP_SIZE: " << default_device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>() << std::endl;
-	return cl::Context({default_device});
+
+
+namespace {
+
+ClUtils::ExecutionMode executionMode = ClUtils::ExecutionMode::EventGraph;
+ClUtils::TransferMode transferMode = ClUtils::TransferMode::Auto;
+bool kernelTimeLogging = true;
+
+// the side length of the pixel tile of a `disparitySplit` work-group, and the pixels per compute unit below which
+// the 2D disparity NDRange is too small to fill the device
+const unsigned splitTile = 4;
+const unsigned splitPixelsPerUnit = 1024;
+
+// a kernel enqueued in event graph mode, waiting for its execution time to be logged
+struct PendingKernel {
+	std::string		progressname;
+	cl_device_id	device;
+	cl::Event		event;
+};
+
+std::vector<PendingKernel> pendingKernels;
+std::mutex pendingKernelsMutex;
+
+void logKernelTime(const std::string& progressname, const cl::Event& ev) {
+	const cl_ulong duration = ev.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ev.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	std::cout << "OpenCL process: " << progressname << " finished in: " << duration / 1e6f << "ms" << std::endl;
+}
+
+}
+
+
+cl::Context ClUtils::initCl(const std::string& deviceOverride) {
+	const auto caps = selectDevice(deviceOverride);
+	logDeviceCaps(caps);
+	return cl::Context({caps.device});
+}
+
+
+std::string ClUtils::DisparityParams::buildOptions() const {
+	std::string options = "-D WINDOW=" + std::to_string(window) + " -D D=" + std::to_string(window / 2)
+		+ " -D MAX_DISP=" + std::to_string(maxDisp) + " -D CROSS_TH=" + std::to_string(crossTh)
+		+ " -D MAX_OFFSET=" + std::to_string(maxOffset)
+		+ " -D GW=" + std::to_string(groupWidth) + " -D GH=" + std::to_string(groupHeight)
+		+ " -D DOWNSCALE=" + std::to_string(downscale) + "f" + " -D STRIP_LEN=" + std::to_string(stripLength);
+	if (blockWidth * blockHeight > 1) {
+		options += " -D BLOCK_X=" + std::to_string(blockWidth) + " -D BLOCK_Y=" + std::to_string(blockHeight);
+	}
+	if (dispLanes > 0) {
+		options += " -D DISP_LANES=" + std::to_string(dispLanes) + " -D SPLIT_TILE=" + std::to_string(splitTile);
+	}
+	if (dispChunk > 0) {
+		options += " -D DISP_CHUNK=" + std::to_string(dispChunk);
+	}
+	if (dispVector > 0) {
+		options += " -D DISP_VEC=" + std::to_string(dispVector);
+	}
+	if (halfMath) {
+		options += " -D HALF_MATH";
+	}
+	if (temporalRange > 0) {
+		options += " -D TEMPORAL_RANGE=" + std::to_string(temporalRange)
+			+ " -D TEMPORAL_MIN_CONF=" + std::to_string(temporalMinConfidence) + "f"
+			+ " -D TEMPORAL_MAX_CHANGE=" + std::to_string(temporalMaxChange) + "f";
+	}
+	return options;
+}
+
+
+cl_channel_type ClUtils::DisparityParams::imageType() const {
+	return storage == StoragePrecision::Half ? CL_HALF_FLOAT : CL_FLOAT;
+}
+
+
+ClUtils::DisparityParams ClUtils::DisparityParams::fitToDevice(const DeviceCaps& caps) const {
+	// the area averages cover at least one input pixel, `main` rejects other values
+	assert(std::isfinite(downscale) && downscale >= 1.f);
+	DisparityParams fitted = *this;
+	// the kernels define D as WINDOW / 2 and sum 2 * D + 1 samples per side
+	fitted.window |= 1u;
+	// disparityBlock.cl has accumulators for blocks of 1, 2 or 4 columns and 1 or 2 rows
+	fitted.blockWidth = fitted.blockWidth >= 4 ? 4 : fitted.blockWidth >= 2 ? 2 : 1;
+	fitted.blockHeight = fitted.blockHeight >= 2 ? 2 : 1;
+	if (fitted.blockWidth != blockWidth || fitted.blockHeight != blockHeight) {
+		std::cout << "unsupported disparity block " << blockWidth << "x" << blockHeight << ", using "
+			<< fitted.blockWidth << "x" << fitted.blockHeight << std::endl;
+	}
+	if (!caps.halfImages) {
+		fitted.storage = StoragePrecision::Float;
+	}
+	fitted.halfMath = fitted.storage == StoragePrecision::Half && caps.hasExtension("cl_khr_fp16");
+	if (fitted.precalcEngine == PrecalcEngine::Auto) {
+		// the summed-area tables cost the same for any window and touch every pixel a few times only, which
+		// suits devices whose local memory is a part of the global memory. The box filter reads its tile
+		// from fast local memory WINDOW times per pixel.
+		fitted.precalcEngine = fitted.window > 25 || !caps.dedicatedLocalMem ? PrecalcEngine::Integral : PrecalcEngine::Separable;
+	}
+	// the tiled kernels keep a float tile of the work-group plus the window halo in local memory, the box filter
+	// also its row sums, the downscale a tile of the input under the work-group, the fused precalc under its tile
+	const auto localBytes = [&fitted]() {
+		const size_t halo = 2 * (fitted.window / 2);
+		size_t windowTile = (fitted.groupWidth + halo) * (fitted.groupHeight + halo);
+		if (fitted.precalcEngine == PrecalcEngine::Separable) {
+			windowTile += 2 * fitted.groupWidth * (fitted.groupHeight + halo);
+		}
+		const size_t blockTile = (fitted.groupWidth * fitted.blockWidth + halo) * (fitted.groupHeight * fitted.blockHeight + halo);
+		windowTile = std::max(windowTile, blockTile);
+		size_t inputTile = (static_cast<size_t>(fitted.groupWidth * fitted.downscale) + 3)
+			* (static_cast<size_t>(fitted.groupHeight * fitted.downscale) + 3);
+		if (fitted.precalcEngine == PrecalcEngine::Fused) {
+			// the fused kernel stages the input under its whole window tile, next to the tile
+			inputTile = (static_cast<size_t>((fitted.groupWidth + halo) * fitted.downscale) + 3)
+				* (static_cast<size_t>((fitted.groupHeight + halo) * fitted.downscale) + 3)
+				+ (fitted.groupWidth + halo) * (fitted.groupHeight + halo);
+		}
+		return std::max(windowTile, inputTile) * sizeof(float);
+	};
+	while (fitted.groupWidth * fitted.groupHeight > caps.maxWorkGroupSize || localBytes() > caps.localMemSize) {
+		if (fitted.groupWidth == 1 && fitted.groupHeight == 1) {
+			break;
+		}
+		if (fitted.groupWidth >= fitted.groupHeight) {
+			fitted.groupWidth = (fitted.groupWidth + 1) / 2;
+		} else {
+			fitted.groupHeight = (fitted.groupHeight + 1) / 2;
+		}
+	}
+
+	// the lanes of a pixel in a work-group of a tile of pixels, next to the left tile and the reduction arrays
+	fitted.dispLanes = 0;
+	if (!caps.isCpu()) {
+		const size_t tileSide = splitTile + 2 * (fitted.window / 2);
+		unsigned lanes = 16;
+		while (lanes >= 2 && (splitTile * splitTile * lanes > caps.maxWorkGroupSize
+			|| (tileSide * tileSide + splitTile * splitTile * lanes * 2) * sizeof(float) > caps.localMemSize)) {
+			lanes /= 2;
+		}
+		fitted.dispLanes = lanes >= 2 ? lanes : 0;
+	}
+
+	// the vector width the device runs float math at, e.g. the SIMD width of a CPU runtime
+	const unsigned vector = caps.preferredFloatVectorWidth;
+	fitted.dispVector = vector >= 16 ? 16 : vector >= 8 ? 8 : vector >= 4 ? 4 : 0;
+
+	// the disparity kernel's right image strip of a chunk of disparities, next to its left tile. Where local memory
+	// is a part of the global memory the sampler's cache does the same job.
+	fitted.dispChunk = 0;
+	if (caps.dedicatedLocalMem) {
+		const size_t halo = 2 * (fitted.window / 2);
+		const size_t sampleBytes = fitted.halfMath ? sizeof(cl_half) : sizeof(float);
+		const size_t leftTile = (fitted.groupWidth + halo) * (fitted.groupHeight + halo) * sampleBytes;
+		const auto stripBytes = [&](size_t chunk) {
+			const size_t stripWidth = fitted.groupWidth + halo + chunk - 1;
+			const size_t pitch = stripWidth + 1 - stripWidth % 2;
+			const size_t statsWidth = fitted.groupWidth + chunk - 1;
+			return (fitted.groupHeight + halo) * pitch * sampleBytes + 2 * fitted.groupHeight * statsWidth * sizeof(float);
+		};
+		unsigned chunk = fitted.maxDisp;
+		while (chunk > 0 && leftTile + stripBytes(chunk) > caps.localMemSize) {
+			--chunk;
+		}
+		// the vector lanes are aligned to the chunks
+		const unsigned lanes = std::max(fitted.dispVector, 1u);
+		chunk = chunk / lanes * lanes;
+		if (chunk > 0) {
+			const unsigned chunks = (fitted.maxDisp + chunk - 1) / chunk;
+			fitted.dispChunk = roundUp((fitted.maxDisp + chunks - 1) / chunks, lanes);
+		}
+	}
+	return fitted;
+}
+
+
+void ClUtils::setExecutionMode(ExecutionMode mode) {
+	executionMode = mode;
+}
+
+
+void ClUtils::setTransferMode(TransferMode mode) {
+	transferMode = mode;
+}
+
+
+bool ClUtils::zeroCopyTransfers(const cl::Context& clCtx) {
+	switch (transferMode) {
+	case TransferMode::Copy: return false;
+	case TransferMode::ZeroCopy: return true;
+	default: return deviceCaps(clCtx).hostUnifiedMemory;
+	}
+}
+
+
+cl::CommandQueue ClUtils::createQueue(const cl::Context& clCtx) {
+	const auto device = clCtx.getInfo<CL_CONTEXT_DEVICES>()[0];
+	cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE;
+	if (executionMode == ExecutionMode::EventGraph && (device.getInfo<CL_DEVICE_QUEUE_PROPERTIES>() & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)) {
+		properties |= CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+	}
+	int clError = 0;
+	cl::CommandQueue queue(clCtx, device, properties, &clError);
+	Logger::logOpenClError(clError, "create command queue");
+	error_quit_program(clError);
+	return queue;
 }
 
 
@@ -53,111 +236,719 @@ std::string ClUtils::readFile(const char* filename) {
 }
 
 
-cl::Kernel ClUtils::loadKernel(const cl::Context& clCtx, const char* filename, const char* kernelname) {
-	auto programText = readFile(filename);
-	cl::Program prepProgram(clCtx, programText);
-	int clError = prepProgram.build();
-	Logger::logOpenClError(clError, "build cl program");
-	error_quit_program(clError);
+cl::Kernel ClUtils::loadKernel(const cl::Context& clCtx, const char* filename, const char* kernelname, const std::string& options) {
+	return ProgramCache::forContext(clCtx).kernel(filename, kernelname, options);
+}
 
-	cl::Kernel kernel(prepProgram, kernelname, &clError);
-	Logger::logOpenClError(clError, filename);
-	error_quit_program(clError);
-	return kernel;
+
+cl::Image2D ClUtils::createGrayClImage(const cl::Context& clCtx, unsigned width, unsigned height, cl_channel_type channelType,
+										cl_mem_flags flags) {
+	return ImagePool::forContext(clCtx).acquire(flags, cl::ImageFormat(CL_R, channelType), width, height);
 }
 
 
-cl::Image2D ClUtils::createGrayClImage(const cl::Context& clCtx, unsigned width, unsigned height, cl_channel_type channelType) {
-	int clError = 0;
-	cl::Image2D clImg(clCtx, CL_MEM_READ_WRITE, cl::ImageFormat(CL_R, channelType), width, height, 0, nullptr, &clError);
-	Logger::logOpenClError(clError, "create OpenCL image");
-	error_quit_program(clError);
-	return clImg;
+cl::Image2D ClUtils::createStatsClImage(const cl::Context& clCtx, unsigned width, unsigned height, cl_channel_type channelType) {
+	return ImagePool::forContext(clCtx).acquire(CL_MEM_READ_WRITE, cl::ImageFormat(CL_RG, channelType), width, height);
 }
 
 
-void ClUtils::runKernel(const cl::CommandQueue& queue, const cl::Kernel& kernel, const cl::NDRange& globalRange, const char* progressname, const cl::NDRange& localRange) {
-		cl::Event ev;
-		int clError = queue.enqueueNDRangeKernel(kernel, cl::NullRange, globalRange, localRange, nullptr, &ev);
-		Logger::logOpenClError(clError, "add kernel to command queue");
-		error_quit_program(clError);
+void ClUtils::releaseImage(const cl::Context& clCtx, const cl::Image2D& image, const std::vector<cl::Event>& lastUses) {
+	ImagePool::forContext(clCtx).release(image, lastUses);
+}
+
+
+cl::Buffer ClUtils::createScratchBuffer(const cl::Context& clCtx, size_t bytes) {
+	return ImagePool::forContext(clCtx).acquireBuffer(CL_MEM_READ_WRITE, bytes);
+}
+
+
+void ClUtils::releaseBuffer(const cl::Context& clCtx, const cl::Buffer& buffer, const std::vector<cl::Event>& lastUses) {
+	ImagePool::forContext(clCtx).release(buffer, lastUses);
+}
+
+
+void ClUtils::releasePrecalcImage(const cl::Context& clCtx, const PrecalcImage& image, const std::vector<cl::Event>& lastUses) {
+	releaseImage(clCtx, image.grayImg, lastUses);
+	releaseImage(clCtx, image.means, lastUses);
+	releaseImage(clCtx, image.stdDev, lastUses);
+	releaseImage(clCtx, image.stats, lastUses);
+}
+
+
+cl::Event ClUtils::runKernel(const cl::CommandQueue& queue, const cl::Kernel& kernel, const cl::NDRange& globalRange, const char* progressname,
+							const cl::NDRange& localRange, const std::vector<cl::Event>* waitEvents) {
+	cl::Event ev;
+	int clError = queue.enqueueNDRangeKernel(kernel, cl::NullRange, globalRange, localRange, waitEvents, &ev);
+	Logger::logOpenClError(clError, "add kernel to command queue");
+	error_quit_program(clError);
+	if (executionMode == ExecutionMode::Blocking) {
 		queue.finish();
-		const cl_ulong duration = ev.getProfilingInfo<CL_PROFILING_COMMAND_END>() - ev.getProfilingInfo<CL_PROFILING_COMMAND_START>();
-		std::cout << "OpenCL process: " << progressname << " finished in: " << duration / 1e6f << "ms" << std::endl;
+		logKernelTime(progressname, ev);
+	} else if (kernelTimeLogging) {
+		const PendingKernel pending{progressname, queue.getInfo<CL_QUEUE_DEVICE>()(), ev};
+		std::lock_guard<std::mutex> lock(pendingKernelsMutex);
+		pendingKernels.push_back(pending);
+	}
+	return ev;
+}
+
+
+void ClUtils::setKernelTimeLogging(bool enabled) {
+	kernelTimeLogging = enabled;
+}
+
+
+void ClUtils::logKernelTimes() {
+	std::vector<PendingKernel> kernels;
+	{
+		std::lock_guard<std::mutex> lock(pendingKernelsMutex);
+		kernels.swap(pendingKernels);
+	}
+	if (kernels.empty()) {
+		return;
+	}
+	std::vector<cl::Event> events;
+	for (const auto& kernel : kernels) {
+		events.push_back(kernel.event);
+	}
+	int clError = cl::WaitForEvents(events);
+	Logger::logOpenClError(clError, "wait for kernels");
+
+	// kernels of one device overlap if they ran concurrently from several queues
+	std::map<cl_device_id, std::vector<std::pair<cl_ulong, cl_ulong>>> intervals;
+	for (const auto& kernel : kernels) {
+		logKernelTime(kernel.progressname, kernel.event);
+		intervals[kernel.device].push_back(std::make_pair(kernel.event.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
+														kernel.event.getProfilingInfo<CL_PROFILING_COMMAND_END>()));
+	}
+	for (auto& device : intervals) {
+		auto& deviceIntervals = device.second;
+		std::sort(deviceIntervals.begin(), deviceIntervals.end());
+		cl_ulong total = 0, busy = 0, mergedEnd = 0;
+		for (const auto& interval : deviceIntervals) {
+			total += interval.second - interval.first;
+			const cl_ulong start = std::max(interval.first, mergedEnd);
+			if (interval.second > start) {
+				busy += interval.second - start;
+			}
+			mergedEnd = std::max(mergedEnd, interval.second);
+		}
+		std::cout << "OpenCL kernels: " << total / 1e6f << "ms total kernel time, " << busy / 1e6f << "ms device busy time, "
+			<< (total - busy) / 1e6f << "ms overlapped" << std::endl;
+	}
 }
 
 
 std::vector<uint8_t> ClUtils::loadImage(const char* filename, unsigned& width, unsigned& height) {
 	std::vector<uint8_t> pixels;
+	loadImage(filename, width, height, pixels);
+	return pixels;
+}
+
+
+void ClUtils::loadImage(const char* filename, unsigned& width, unsigned& height, std::vector<uint8_t>& pixels) {
+	// the decoder appends to the vector
+	pixels.clear();
 	unsigned error = lodepng::decode(pixels, width, height, filename, LCT_RGBA);
 	Logger::logLoad(error, filename);
 	error_quit_program(error);
-	return pixels;
 }
 
 
-ClUtils::PrecalcImage ClUtils::precalcImage(const cl::Context& clCtx, const cl::CommandQueue& queue, std::vector<uint8_t>& pixels, unsigned width, unsigned height) {
+cl::Image2D ClUtils::uploadInputImage(const cl::Context& clCtx, const cl::CommandQueue& queue, std::vector<uint8_t>& pixels, unsigned width, unsigned height,
+										std::vector<cl::Event>& uploadDone) {
 	int clError = 0;
+	uploadDone.clear();
+	if (zeroCopyTransfers(clCtx)) {
+		// a pooled image in host accessible memory, the decoded pixels are copied into its mapping on the host
+		// and the device reads them in place. Allocated by the runtime, so it is aligned as the device needs.
+		auto clInImg = ImagePool::forContext(clCtx).acquire(CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8), width, height);
+		cl::size_t<3> region;
+		region[0] = width;
+		region[1] = height;
+		region[2] = 1;
+		size_t rowPitch = 0;
+		auto mapped = static_cast<uint8_t*>(queue.enqueueMapImage(clInImg, CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION, cl::size_t<3>(), region,
+																	&rowPitch, nullptr, nullptr, nullptr, &clError));
+		Logger::logOpenClError(clError, "map OpenCL input image");
+		error_quit_program(clError);
+		const size_t rowBytes = width * 4;
+		for (unsigned y = 0; y < height; ++y) {
+			std::copy(pixels.begin() + y * rowBytes, pixels.begin() + (y + 1) * rowBytes, mapped + y * rowPitch);
+		}
+		uploadDone.resize(1);
+		clError = queue.enqueueUnmapMemObject(clInImg, mapped, nullptr, &uploadDone[0]);
+		Logger::logOpenClError(clError, "unmap OpenCL input image");
+		error_quit_program(clError);
+		return clInImg;
+	}
 
-	// create input OpenCL image
-	cl::Image2D clInImg(clCtx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8), width, height, 0, pixels.data(), &clError);
-	Logger::logOpenClError(clError, "create OpenCL image from png");
+	// upload the input to a pooled OpenCL image
+	auto clInImg = ImagePool::forContext(clCtx).acquire(CL_MEM_READ_ONLY, cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8), width, height);
+	cl::size_t<3> region;
+	region[0] = width;
+	region[1] = height;
+	region[2] = 1;
+	uploadDone.resize(1);
+	clError = queue.enqueueWriteImage(clInImg, CL_FALSE, cl::size_t<3>(), region, 0, 0, pixels.data(), nullptr, &uploadDone[0]);
+	Logger::logOpenClError(clError, "upload png to OpenCL image");
 	error_quit_program(clError);
+	return clInImg;
+}
+
 
+ClUtils::PrecalcImage ClUtils::precalcImage(const cl::Context& clCtx, const cl::CommandQueue& queue, std::vector<uint8_t>& pixels, unsigned width, unsigned height,
+											const DisparityParams& params) {
+	std::vector<cl::Event> uploadDone;
+	auto clInImg = uploadInputImage(clCtx, queue, pixels, width, height, uploadDone);
+	auto result = precalcImage(clCtx, queue, clInImg, width, height, params, &uploadDone);
+	// the input is not needed once all of the precalculated images are ready
+	releaseImage(clCtx, clInImg, {result.ready});
+	return result;
+}
+
+
+ClUtils::PrecalcImage ClUtils::precalcImage(const cl::Context& clCtx, const cl::CommandQueue& queue, const cl::Image2D& clInImg,
+											unsigned width, unsigned height, const DisparityParams& params, const std::vector<cl::Event>* waitEvents) {
 	// create OpenCL image for the preprocessed data
-	const unsigned outWidth = width / 4;
-	const unsigned outHeight = height / 4;
-	auto clPrepImg = createGrayClImage(clCtx, outWidth, outHeight);
+	const unsigned outWidth = static_cast<unsigned>(width / params.downscale);
+	const unsigned outHeight = static_cast<unsigned>(height / params.downscale);
+	auto clPrepImg = createGrayClImage(clCtx, outWidth, outHeight, params.imageType());
 
-	// run preprocess kernel
-	{
-		auto preprocessKernel = loadKernel(clCtx, "preprocess.cl", "preprocess");
-		preprocessKernel.setArg(0, clInImg);
-		preprocessKernel.setArg(1, clPrepImg);
-		runKernel(queue, preprocessKernel, cl::NDRange(outWidth, outHeight), "preprocess kernel");
+	if (params.precalcEngine == PrecalcEngine::Fused) {
+		auto clMeansImg = createGrayClImage(clCtx, outWidth, outHeight, params.imageType());
+		auto clStdImg = createGrayClImage(clCtx, outWidth, outHeight, params.imageType());
+		auto clStatsImg = createStatsClImage(clCtx, outWidth, outHeight, params.imageType());
+		auto precalcKernel = loadKernel(clCtx, "precalc.cl", "precalc", params.buildOptions());
+		precalcKernel.setArg(0, clInImg);
+		precalcKernel.setArg(1, clPrepImg);
+		precalcKernel.setArg(2, clMeansImg);
+		precalcKernel.setArg(3, clStdImg);
+		precalcKernel.setArg(4, clStatsImg);
+		const cl::NDRange globalRange(roundUp(outWidth, params.groupWidth), roundUp(outHeight, params.groupHeight));
+		auto precalcDone = runKernel(queue, precalcKernel, globalRange, "precalc kernel", cl::NDRange(params.groupWidth, params.groupHeight), waitEvents);
+		return {outWidth, outHeight, clPrepImg, clMeansImg, clStdImg, clStatsImg, precalcDone};
 	}
 
-	// create OpenCL image for mean data
-	auto clMeansImg = createGrayClImage(clCtx, outWidth, outHeight);
+	// run preprocess kernel
+	auto preprocessKernel = loadKernel(clCtx, "preprocess.cl", "preprocess", params.buildOptions());
+	preprocessKernel.setArg(0, clInImg);
+	preprocessKernel.setArg(1, clPrepImg);
+	const cl::NDRange globalRange(roundUp(outWidth, params.groupWidth), roundUp(outHeight, params.groupHeight));
+	auto prepDone = runKernel(queue, preprocessKernel, globalRange, "preprocess kernel", cl::NDRange(params.groupWidth, params.groupHeight), waitEvents);
+	return windowStatistics(clCtx, queue, clPrepImg, outWidth, outHeight, params, prepDone);
+}
+
 
-	// run mean kernel
-	{
-		auto meanKernel = loadKernel(clCtx, "mean.cl", "mean");
-		meanKernel.setArg(0, clPrepImg);
-		meanKernel.setArg(1, clMeansImg);
-		runKernel(queue, meanKernel, cl::NDRange(outWidth, outHeight), "mean kernel");
-	}
+ClUtils::PrecalcImage ClUtils::windowStatistics(const cl::Context& clCtx, const cl::CommandQueue& queue, const cl::Image2D& gray,
+												unsigned width, unsigned height, const DisparityParams& params, const cl::Event& grayDone) {
+	auto clMeansImg = createGrayClImage(clCtx, width, height, params.imageType());
+	auto clStdImg = createGrayClImage(clCtx, width, height, params.imageType());
+	cl::Event stdDone;
 
-	// create OpenCL image for std data
-	auto clStdImg = createGrayClImage(clCtx, outWidth, outHeight);
+	if (params.precalcEngine == PrecalcEngine::Integral) {
+		// the table of the gray image padded by the window radius, plus a leading zero row and column
+		const unsigned tableWidth = width + 2 * (params.window / 2) + 1;
+		const unsigned tableHeight = height + 2 * (params.window / 2) + 1;
+		const auto table = createScratchBuffer(clCtx, static_cast<size_t>(tableWidth) * tableHeight * 2 * sizeof(cl_ulong));
 
-	// run stdDev kernel
-	{
-		auto stdDevKernel = loadKernel(clCtx, "std_dev.cl", "stdDev");
-		stdDevKernel.setArg(0, clPrepImg);
-		stdDevKernel.setArg(1, clMeansImg);
-		stdDevKernel.setArg(2, clStdImg);
-		runKernel(queue, stdDevKernel, cl::NDRange(outWidth, outHeight), "std dev kernel");
+		// the widest power of two work-group scanning a row
+		unsigned scanWidth = 1;
+		while (scanWidth * 2 <= std::min<size_t>(256, deviceCaps(clCtx).maxWorkGroupSize)) {
+			scanWidth *= 2;
+		}
+		const std::string options = params.buildOptions() + " -D SCAN_WIDTH=" + std::to_string(scanWidth);
+		cl::Event rowsDone, columnsDone;
+
+		auto rowsKernel = loadKernel(clCtx, "integral.cl", "integralRows", options);
+		rowsKernel.setArg(0, gray);
+		rowsKernel.setArg(1, table);
+		rowsKernel.setArg(2, static_cast<int>(tableWidth));
+		const std::vector<cl::Event> grayWait{grayDone};
+		rowsDone = runKernel(queue, rowsKernel, cl::NDRange(scanWidth, tableHeight), "integral rows kernel", cl::NDRange(scanWidth, 1), &grayWait);
+
+		auto columnsKernel = loadKernel(clCtx, "integral.cl", "integralColumns", options);
+		columnsKernel.setArg(0, table);
+		columnsKernel.setArg(1, static_cast<int>(tableWidth));
+		columnsKernel.setArg(2, static_cast<int>(tableHeight));
+		const std::vector<cl::Event> rowsWait{rowsDone};
+		columnsDone = runKernel(queue, columnsKernel, cl::NDRange(tableWidth), "integral columns kernel", cl::NullRange, &rowsWait);
+
+		auto statsKernel = loadKernel(clCtx, "integral.cl", "integralStats", options);
+		statsKernel.setArg(0, table);
+		statsKernel.setArg(1, static_cast<int>(tableWidth));
+		statsKernel.setArg(2, clMeansImg);
+		statsKernel.setArg(3, clStdImg);
+		const std::vector<cl::Event> columnsWait{columnsDone};
+		stdDone = runKernel(queue, statsKernel, cl::NDRange(width, height), "integral stats kernel", cl::NullRange, &columnsWait);
+		releaseBuffer(clCtx, table, {stdDone});
+	} else if (params.precalcEngine == PrecalcEngine::Separable) {
+		auto boxKernel = loadKernel(clCtx, "boxFilter.cl", "boxFilter", params.buildOptions());
+		boxKernel.setArg(0, gray);
+		boxKernel.setArg(1, clMeansImg);
+		boxKernel.setArg(2, clStdImg);
+		const std::vector<cl::Event> waitEvents{grayDone};
+		const cl::NDRange globalRange(roundUp(width, params.groupWidth), roundUp(height, params.groupHeight));
+		stdDone = runKernel(queue, boxKernel, globalRange, "box filter kernel", cl::NDRange(params.groupWidth, params.groupHeight), &waitEvents);
+	} else {
+		cl::Event meanDone;
+
+		// run mean kernel
+		{
+			auto meanKernel = loadKernel(clCtx, "mean.cl", "mean", params.buildOptions());
+			meanKernel.setArg(0, gray);
+			meanKernel.setArg(1, clMeansImg);
+			const std::vector<cl::Event> waitEvents{grayDone};
+			meanDone = runKernel(queue, meanKernel, cl::NDRange(width, height), "mean kernel", cl::NullRange, &waitEvents);
+		}
+
+		// run stdDev kernel
+		{
+			auto stdDevKernel = loadKernel(clCtx, "std_dev.cl", "stdDev", params.buildOptions());
+			stdDevKernel.setArg(0, gray);
+			stdDevKernel.setArg(1, clMeansImg);
+			stdDevKernel.setArg(2, clStdImg);
+			const std::vector<cl::Event> waitEvents{meanDone};
+			stdDone = runKernel(queue, stdDevKernel, cl::NDRange(width, height), "std dev kernel", cl::NullRange, &waitEvents);
+		}
 	}
 
+	// pack the normalization terms of the disparity kernel
+	auto clStatsImg = createStatsClImage(clCtx, width, height, params.imageType());
+	auto packKernel = loadKernel(clCtx, "packStats.cl", "packStats", params.buildOptions());
+	packKernel.setArg(0, clMeansImg);
+	packKernel.setArg(1, clStdImg);
+	packKernel.setArg(2, clStatsImg);
+	const std::vector<cl::Event> waitEvents{stdDone};
+	auto packDone = runKernel(queue, packKernel, cl::NDRange(width, height), "pack stats kernel", cl::NullRange, &waitEvents);
+
 	// assemble output
-	return {outWidth, outHeight, clPrepImg, clMeansImg, clStdImg};
+	return {width, height, gray, clMeansImg, clStdImg, clStatsImg, packDone};
+}
+
+
+void ClUtils::benchmarkWindowStatistics(const cl::Context& clCtx, const cl::CommandQueue& queue, std::vector<uint8_t>& pixels,
+										unsigned width, unsigned height, const DisparityParams& params, unsigned repeats) {
+	// float storage, `readFloats` reads the statistics as floats
+	DisparityParams floatParams = params;
+	floatParams.storage = StoragePrecision::Float;
+	DisparityParams engineParams = floatParams;
+	engineParams.precalcEngine = PrecalcEngine::Separate;
+	auto input = precalcImage(clCtx, queue, pixels, width, height, engineParams);
+	queue.finish();
+	cl::size_t<3> region;
+	region[0] = input.width;
+	region[1] = input.height;
+	region[2] = 1;
+	const auto readFloats = [&](const cl::Image2D& image) {
+		std::vector<float> values(input.width * input.height);
+		int clError = queue.enqueueReadImage(image, CL_TRUE, cl::size_t<3>(), region, 0, 0, values.data());
+		Logger::logOpenClError(clError, "read back window statistics");
+		error_quit_program(clError);
+		return values;
+	};
+	const auto maxDifference = [](const std::vector<float>& a, const std::vector<float>& b) {
+		float difference = 0.f;
+		for (size_t i = 0; i < a.size(); ++i) {
+			difference = std::max(difference, std::abs(a[i] - b[i]));
+		}
+		return difference;
+	};
+	const auto referenceMeans = readFloats(input.means);
+	const auto referenceStdDev = readFloats(input.stdDev);
+
+	const std::pair<PrecalcEngine, const char*> engines[] = {
+		{PrecalcEngine::Separate, "direct"}, {PrecalcEngine::Separable, "box filter"}, {PrecalcEngine::Integral, "integral"}};
+	for (const auto& engine : engines) {
+		engineParams = floatParams;
+		engineParams.precalcEngine = engine.first;
+		engineParams = engineParams.fitToDevice(deviceCaps(clCtx));
+		// the first run builds the programs and fills the image pool
+		const auto stats = windowStatistics(clCtx, queue, input.grayImg, input.width, input.height, engineParams, input.ready);
+		queue.finish();
+		const float meanDifference = maxDifference(readFloats(stats.means), referenceMeans);
+		const float stdDevDifference = maxDifference(readFloats(stats.stdDev), referenceStdDev);
+		releaseImage(clCtx, stats.means, {});
+		releaseImage(clCtx, stats.stdDev, {});
+		releaseImage(clCtx, stats.stats, {});
+
+		const auto start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < repeats; ++i) {
+			const auto timed = windowStatistics(clCtx, queue, input.grayImg, input.width, input.height, engineParams, input.ready);
+			releaseImage(clCtx, timed.means, {timed.ready});
+			releaseImage(clCtx, timed.stdDev, {timed.ready});
+			releaseImage(clCtx, timed.stats, {timed.ready});
+		}
+		queue.finish();
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::cout << "window statistics: " << engine.second << " " << seconds * 1e3 / std::max(repeats, 1u) << "ms per image, max difference "
+			<< meanDifference << " in the means, " << stdDevDifference << " in the std devs" << std::endl;
+	}
+	releasePrecalcImage(clCtx, input, {});
 }
 
 
-cl::Image2D ClUtils::calculateDisparityMap(const cl::Context& clCtx, const cl::CommandQueue& queue, const PrecalcImage& left, const PrecalcImage& right, bool invertD) {
+cl::Image2D ClUtils::calculateDisparityMap(const cl::Context& clCtx, const cl::CommandQueue& queue, const PrecalcImage& left, const PrecalcImage& right, bool invertD,
+												const DisparityParams& params, cl::Event* event, TemporalFrame* temporal) {
+	if (params.temporalRange > 0 && !temporal) {
+		// a single pair has no previous frame
+		DisparityParams fullRange = params;
+		fullRange.temporalRange = 0;
+		return calculateDisparityMap(clCtx, queue, left, right, invertD, fullRange, event);
+	}
+
 	auto outImg = createGrayClImage(clCtx, left.width, left.height, CL_UNSIGNED_INT8);
-	{
-		auto dispKernel = loadKernel(clCtx, "disparity.cl", "disparity");
-		dispKernel.setArg(0, outImg);
-		dispKernel.setArg(1, left.grayImg);
-		dispKernel.setArg(2, right.grayImg);
-		dispKernel.setArg(3, left.means);
-		dispKernel.setArg(4, right.means);
-		dispKernel.setArg(5, left.stdDev);
-		dispKernel.setArg(6, right.stdDev);
-		dispKernel.setArg(7, invertD ? 1 : 0);
-		runKernel(queue, dispKernel, cl::NDRange(left.width, left.height), "disparity kernel", cl::NDRange(GW, GH));
+	std::vector<cl::Event> waitEvents{left.ready, right.ready};
+
+	if (params.disparityEngine == DisparityEngine::CostVolume && params.temporalRange == 0) {
+		// as many disparity slices per volume as the largest allocation holds
+		const size_t sliceBytes = static_cast<size_t>(left.width) * left.height * sizeof(cl_int);
+		const unsigned slices = static_cast<unsigned>(std::max<size_t>(std::min<size_t>(params.maxDisp, deviceCaps(clCtx).maxAllocSize / sliceBytes), 1));
+		const auto volume = createScratchBuffer(clCtx, slices * sliceBytes);
+		const auto bestZncc = createScratchBuffer(clCtx, static_cast<size_t>(left.width) * left.height * sizeof(cl_float));
+		const auto bestDisp = createScratchBuffer(clCtx, static_cast<size_t>(left.width) * left.height * sizeof(cl_int));
+
+		auto rowsKernel = loadKernel(clCtx, "costVolume.cl", "costRows", params.buildOptions());
+		auto columnsKernel = loadKernel(clCtx, "costVolume.cl", "costColumns", params.buildOptions());
+		auto selectKernel = loadKernel(clCtx, "costVolume.cl", "selectDisparity", params.buildOptions());
+		cl::Event selectDone;
+		for (unsigned firstDisp = 0; firstDisp < params.maxDisp; firstDisp += slices) {
+			const unsigned volumeSlices = std::min(slices, params.maxDisp - firstDisp);
+			rowsKernel.setArg(0, left.grayImg);
+			rowsKernel.setArg(1, right.grayImg);
+			rowsKernel.setArg(2, volume);
+			rowsKernel.setArg(3, invertD ? 1 : 0);
+			rowsKernel.setArg(4, static_cast<int>(firstDisp));
+			// the previous volume must be consumed before it is overwritten
+			auto rowsDone = runKernel(queue, rowsKernel, cl::NDRange(left.height, volumeSlices), "cost rows kernel", cl::NullRange, &waitEvents);
+
+			columnsKernel.setArg(0, volume);
+			columnsKernel.setArg(1, left.stats);
+			columnsKernel.setArg(2, right.stats);
+			columnsKernel.setArg(3, invertD ? 1 : 0);
+			columnsKernel.setArg(4, static_cast<int>(firstDisp));
+			const std::vector<cl::Event> rowsWait{rowsDone};
+			auto columnsDone = runKernel(queue, columnsKernel, cl::NDRange(left.width, volumeSlices), "cost columns kernel", cl::NullRange, &rowsWait);
+
+			selectKernel.setArg(0, volume);
+			selectKernel.setArg(1, bestZncc);
+			selectKernel.setArg(2, bestDisp);
+			selectKernel.setArg(3, outImg);
+			selectKernel.setArg(4, static_cast<int>(firstDisp));
+			selectKernel.setArg(5, static_cast<int>(volumeSlices));
+			selectKernel.setArg(6, firstDisp + volumeSlices >= params.maxDisp ? 1 : 0);
+			const std::vector<cl::Event> columnsWait{columnsDone};
+			selectDone = runKernel(queue, selectKernel, cl::NDRange(left.width, left.height), "select disparity kernel", cl::NullRange, &columnsWait);
+			waitEvents = {selectDone};
+		}
+		releaseBuffer(clCtx, volume, {selectDone});
+		releaseBuffer(clCtx, bestZncc, {selectDone});
+		releaseBuffer(clCtx, bestDisp, {selectDone});
+		if (event) {
+			*event = selectDone;
+		}
+		return outImg;
+	}
+	if (params.disparityEngine == DisparityEngine::Strip && params.temporalRange == 0) {
+		auto stripKernel = loadKernel(clCtx, "disparityStrip.cl", "disparityStrip", params.buildOptions());
+		stripKernel.setArg(0, outImg);
+		stripKernel.setArg(1, left.grayImg);
+		stripKernel.setArg(2, right.grayImg);
+		stripKernel.setArg(3, left.stats);
+		stripKernel.setArg(4, right.stats);
+		stripKernel.setArg(5, invertD ? 1 : 0);
+		// one work-item per strip, the strips of a row run side by side
+		const cl::NDRange globalRange((left.width + params.stripLength - 1) / params.stripLength, left.height);
+		auto stripDone = runKernel(queue, stripKernel, globalRange, "disparity strip kernel", cl::NullRange, &waitEvents);
+		if (event) {
+			*event = stripDone;
+		}
+		return outImg;
+	}
+	cl::Image2D confidenceImg;
+	if (params.temporalRange > 0) {
+		if (!temporal->confidence() || temporal->confidence.getImageInfo<CL_IMAGE_WIDTH>() != left.width
+			|| temporal->confidence.getImageInfo<CL_IMAGE_HEIGHT>() != left.height) {
+			// first frame or new frame size: zero confidence makes every pixel search the full range
+			releaseImage(clCtx, temporal->disparity, {temporal->ready});
+			releaseImage(clCtx, temporal->confidence, {temporal->ready});
+			releaseImage(clCtx, temporal->means, {temporal->ready});
+			temporal->disparity = createGrayClImage(clCtx, left.width, left.height, CL_UNSIGNED_INT8);
+			temporal->confidence = createGrayClImage(clCtx, left.width, left.height);
+			temporal->means = createGrayClImage(clCtx, left.width, left.height);
+			cl::size_t<3> region;
+			region[0] = left.width;
+			region[1] = left.height;
+			region[2] = 1;
+			const cl_float4 zero = {{0.f, 0.f, 0.f, 0.f}};
+			int clError = queue.enqueueFillImage(temporal->confidence, zero, cl::size_t<3>(), region, nullptr, &temporal->ready);
+			Logger::logOpenClError(clError, "clear temporal confidence");
+			error_quit_program(clError);
+		}
+		waitEvents.push_back(temporal->ready);
+		confidenceImg = createGrayClImage(clCtx, left.width, left.height);
+	}
+
+	if (params.dispLanes > 0 && params.disparityEngine == DisparityEngine::Window && params.temporalRange == 0
+		&& left.width * left.height < deviceCaps(clCtx).computeUnits * splitPixelsPerUnit) {
+		auto splitKernel = loadKernel(clCtx, "disparitySplit.cl", "disparitySplit", params.buildOptions());
+		splitKernel.setArg(0, outImg);
+		splitKernel.setArg(1, left.grayImg);
+		splitKernel.setArg(2, right.grayImg);
+		splitKernel.setArg(3, left.stats);
+		splitKernel.setArg(4, right.stats);
+		splitKernel.setArg(5, invertD ? 1 : 0);
+		// the third dimension holds the lanes of every pixel, all in one work-group
+		const cl::NDRange globalRange(roundUp(left.width, splitTile), roundUp(left.height, splitTile), params.dispLanes);
+		auto splitDone = runKernel(queue, splitKernel, globalRange, "disparity split kernel", cl::NDRange(splitTile, splitTile, params.dispLanes), &waitEvents);
+		if (event) {
+			*event = splitDone;
+		}
+		return outImg;
+	}
+
+	// the blocked kernel scores several pixels per work-item and has no temporal search
+	const bool blocked = params.blockWidth * params.blockHeight > 1 && params.temporalRange == 0;
+	auto dispKernel = blocked ? loadKernel(clCtx, "disparityBlock.cl", "disparityBlock", params.buildOptions())
+		: loadKernel(clCtx, "disparity.cl", "disparity", params.buildOptions());
+	dispKernel.setArg(0, outImg);
+	dispKernel.setArg(1, left.grayImg);
+	dispKernel.setArg(2, right.grayImg);
+	dispKernel.setArg(3, left.stats);
+	dispKernel.setArg(4, right.stats);
+	dispKernel.setArg(5, invertD ? 1 : 0);
+	if (params.temporalRange > 0) {
+		dispKernel.setArg(6, temporal->disparity);
+		dispKernel.setArg(7, temporal->confidence);
+		dispKernel.setArg(8, temporal->means);
+		dispKernel.setArg(9, confidenceImg);
+	}
+	const unsigned blockWidth = blocked ? params.blockWidth : 1, blockHeight = blocked ? params.blockHeight : 1;
+	const cl::NDRange globalRange(roundUp((left.width + blockWidth - 1) / blockWidth, params.groupWidth),
+								  roundUp((left.height + blockHeight - 1) / blockHeight, params.groupHeight));
+	auto dispDone = runKernel(queue, dispKernel, globalRange, "disparity kernel", cl::NDRange(params.groupWidth, params.groupHeight), &waitEvents);
+	if (event) {
+		*event = dispDone;
+	}
+
+	if (params.temporalRange > 0) {
+		// this frame seeds the next one, the previous frame is done with
+		releaseImage(clCtx, temporal->disparity, {dispDone});
+		releaseImage(clCtx, temporal->confidence, {dispDone});
+		releaseImage(clCtx, temporal->means, {dispDone});
+		*temporal = {outImg, confidenceImg, left.means, dispDone};
+	}
+	return outImg;
+}
+
+
+void ClUtils::releaseTemporalState(const cl::Context& clCtx, TemporalState& state) {
+	for (auto frame : {&state.left, &state.right}) {
+		releaseImage(clCtx, frame->disparity, {frame->ready});
+		releaseImage(clCtx, frame->confidence, {frame->ready});
+		releaseImage(clCtx, frame->means, {frame->ready});
+		*frame = TemporalFrame();
+	}
+}
+
+
+cl::Image2D ClUtils::crossCheck(const cl::Context& clCtx, const cl::CommandQueue& queue, const cl::Image2D& leftDisp, const cl::Image2D& rightDisp,
+								unsigned width, unsigned height, const DisparityParams& params,
+								const std::vector<cl::Event>* waitEvents, cl::Event* event) {
+	auto crossCheckImg = createGrayClImage(clCtx, width, height, CL_UNSIGNED_INT8);
+	auto crossCheckKernel = loadKernel(clCtx, "crossCheck.cl", "crossCheck", params.buildOptions());
+	crossCheckKernel.setArg(0, crossCheckImg);
+	crossCheckKernel.setArg(1, leftDisp);
+	crossCheckKernel.setArg(2, rightDisp);
+	auto crossCheckDone = runKernel(queue, crossCheckKernel, cl::NDRange(width, height), "cross check kernel", cl::NullRange, waitEvents);
+	if (event) {
+		*event = crossCheckDone;
+	}
+	return crossCheckImg;
+}
+
+
+cl::Image2D ClUtils::fillOcclusions(const cl::Context& clCtx, const cl::CommandQueue& queue, const cl::Image2D& input,
+									unsigned width, unsigned height, const DisparityParams& params,
+									const std::vector<cl::Event>* waitEvents, cl::Event* event) {
+	// the final map is the one read by the host, so it lives in host accessible memory for zero-copy mapping
+	const cl_mem_flags flags = zeroCopyTransfers(clCtx) ? CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR : CL_MEM_READ_WRITE;
+	auto outImg = createGrayClImage(clCtx, width, height, CL_UNSIGNED_INT8, flags);
+	auto occlusionKernel = loadKernel(clCtx, "occlusionFill.cl", "occlusionFill", params.buildOptions());
+	occlusionKernel.setArg(0, outImg);
+	occlusionKernel.setArg(1, input);
+	auto occlusionDone = runKernel(queue, occlusionKernel, cl::NDRange(width, height), "occlusionFill kernel", cl::NullRange, waitEvents);
+	if (event) {
+		*event = occlusionDone;
 	}
 	return outImg;
 }
+
+
+std::vector<uint8_t> ClUtils::readGrayImage(const cl::CommandQueue& queue, const cl::Image2D& image, unsigned width, unsigned height,
+											const std::vector<cl::Event>* waitEvents) {
+	std::vector<uint8_t> pixels;
+	readGrayImage(queue, image, width, height, pixels, waitEvents);
+	return pixels;
+}
+
+
+void ClUtils::readGrayImage(const cl::CommandQueue& queue, const cl::Image2D& image, unsigned width, unsigned height,
+							std::vector<uint8_t>& pixels, const std::vector<cl::Event>* waitEvents) {
+	pixels.resize(width * height);
+	cl::size_t<3> size;
+	size[0] = width;
+	size[1] = height;
+	size[2] = 1;
+	if (!zeroCopyTransfers(queue.getInfo<CL_QUEUE_CONTEXT>())) {
+		int clError = queue.enqueueReadImage(image, CL_TRUE, cl::size_t<3>(), size, 0, 0, pixels.data(), waitEvents);
+		Logger::logOpenClError(clError, "read computed image");
+		error_quit_program(clError);
+		return;
+	}
+
+	// the output of `fillOcclusions` is in host accessible memory, mapping it makes no device copy
+	size_t rowPitch = 0;
+	int clError = 0;
+	auto mapped = static_cast<const uint8_t*>(queue.enqueueMapImage(image, CL_TRUE, CL_MAP_READ, cl::size_t<3>(), size, &rowPitch, nullptr,
+																	waitEvents, nullptr, &clError));
+	Logger::logOpenClError(clError, "map computed image");
+	error_quit_program(clError);
+	for (unsigned y = 0; y < height; ++y) {
+		std::copy(mapped + y * rowPitch, mapped + y * rowPitch + width, pixels.begin() + y * width);
+	}
+	cl::Event unmapDone;
+	clError = queue.enqueueUnmapMemObject(image, const_cast<uint8_t*>(mapped), nullptr, &unmapDone);
+	Logger::logOpenClError(clError, "unmap computed image");
+	error_quit_program(clError);
+	unmapDone.wait();
+}
+
+
+ClUtils::DisparityResult ClUtils::computeDisparity(const cl::Context& clCtx, const cl::CommandQueue& leftQueue, const cl::CommandQueue& rightQueue,
+												std::vector<uint8_t>& pixelsL, std::vector<uint8_t>& pixelsR, unsigned width, unsigned height,
+												const DisparityParams& params) {
+	if (params.pyramidLevels > 1) {
+		return computePyramidDisparity(clCtx, leftQueue, rightQueue, pixelsL, pixelsR, width, height, params);
+	}
+
+	// the left and right chains only meet at the disparity passes and the cross-check
+	auto imDataL = precalcImage(clCtx, leftQueue, pixelsL, width, height, params);
+	auto imDataR = precalcImage(clCtx, rightQueue, pixelsR, width, height, params);
+	leftQueue.flush();
+	rightQueue.flush();
+	return computeDisparity(clCtx, leftQueue, rightQueue, imDataL, imDataR, params);
+}
+
+
+ClUtils::DisparityResult ClUtils::computeDisparity(const cl::Context& clCtx, const cl::CommandQueue& leftQueue, const cl::CommandQueue& rightQueue,
+												const PrecalcImage& imDataL, const PrecalcImage& imDataR, const DisparityParams& params,
+												TemporalState* temporal) {
+	const bool keepFrame = temporal && params.temporalRange > 0;
+	std::vector<cl::Event> dispDone(2);
+	auto dispL = calculateDisparityMap(clCtx, leftQueue, imDataL, imDataR, false, params, &dispDone[0], keepFrame ? &temporal->left : nullptr);
+	auto dispR = calculateDisparityMap(clCtx, rightQueue, imDataR, imDataL, true, params, &dispDone[1], keepFrame ? &temporal->right : nullptr);
+	rightQueue.flush();
+	if (keepFrame) {
+		// the disparity maps and the means now belong to the temporal state
+		for (const auto imData : {&imDataL, &imDataR}) {
+			releaseImage(clCtx, imData->grayImg, dispDone);
+			releaseImage(clCtx, imData->stdDev, dispDone);
+			releaseImage(clCtx, imData->stats, dispDone);
+		}
+	} else {
+		releasePrecalcImage(clCtx, imDataL, dispDone);
+		releasePrecalcImage(clCtx, imDataR, dispDone);
+	}
+
+	std::vector<cl::Event> crossCheckDone(1);
+	auto crossCheckImg = crossCheck(clCtx, leftQueue, dispL, dispR, imDataL.width, imDataL.height, params, &dispDone, &crossCheckDone[0]);
+	if (keepFrame) {
+		// the next frame recycles the disparity maps after `ready`, which has to cover the cross-check reading them
+		temporal->left.ready = crossCheckDone[0];
+		temporal->right.ready = crossCheckDone[0];
+	} else {
+		releaseImage(clCtx, dispL, crossCheckDone);
+		releaseImage(clCtx, dispR, crossCheckDone);
+	}
+	cl::Event occlusionDone;
+	auto outImg = fillOcclusions(clCtx, leftQueue, crossCheckImg, imDataL.width, imDataL.height, params, &crossCheckDone, &occlusionDone);
+	releaseImage(clCtx, crossCheckImg, {occlusionDone});
+	leftQueue.flush();
+	return {imDataL.width, imDataL.height, outImg, occlusionDone};
+}
+
+
+void ClUtils::logPrecisionDifference(const cl::Context& clCtx, const cl::CommandQueue& leftQueue, const cl::CommandQueue& rightQueue,
+									std::vector<uint8_t>& pixelsL, std::vector<uint8_t>& pixelsR, unsigned width, unsigned height,
+									const DisparityParams& params) {
+	// the tile sizes fitted for half samples can exceed the local memory with float samples
+	const auto& caps = deviceCaps(clCtx);
+	const DisparityParams halfParams = params.fitToDevice(caps);
+	DisparityParams floatParams = params;
+	floatParams.storage = StoragePrecision::Float;
+	floatParams = floatParams.fitToDevice(caps);
+	std::vector<uint8_t> maps[2];
+	unsigned i = 0;
+	for (const auto& runParams : {halfParams, floatParams}) {
+		auto result = computeDisparity(clCtx, leftQueue, rightQueue, pixelsL, pixelsR, width, height, runParams);
+		const std::vector<cl::Event> waitEvents{result.ready};
+		readGrayImage(leftQueue, result.image, result.width, result.height, maps[i++], &waitEvents);
+		releaseImage(clCtx, result.image, {});
+	}
+
+	// the maps hold the disparities scaled to 0-255
+	const double levelsPerDisparity = 255.0 / params.maxDisp;
+	double differenceSum = 0.0;
+	size_t differing = 0;
+	for (size_t pixel = 0; pixel < maps[0].size(); ++pixel) {
+		const double difference = std::abs(maps[0][pixel] - maps[1][pixel]) / levelsPerDisparity;
+		differenceSum += difference;
+		if (difference > 1.0) {
+			++differing;
+		}
+	}
+	const size_t pixels = std::max<size_t>(maps[0].size(), 1);
+	std::cout << "precision: " << (halfParams.halfMath ? "half storage and math" : halfParams.storage == StoragePrecision::Half ? "half storage" : "float storage")
+		<< " differs from float by " << differenceSum / pixels << " disparities on average, " << 100.0 * differing / pixels
+		<< "% of the pixels by more than one" << std::endl;
+}
+
+
+void ClUtils::saveGrayImage(const cl::CommandQueue& queue, const cl::Image2D& image, unsigned width, unsigned height,
+							const char* filename, const std::vector<cl::Event>* waitEvents) {
+	unsigned error = 0;
+	if (!zeroCopyTransfers(queue.getInfo<CL_QUEUE_CONTEXT>())) {
+		const auto pixels = readGrayImage(queue, image, width, height, waitEvents);
+		error = lodepng::encode(filename, pixels, width, height, LCT_GREY, 8);
+		Logger::logSave(error, filename);
+		return;
+	}
+
+	cl::size_t<3> region;
+	region[0] = width;
+	region[1] = height;
+	region[2] = 1;
+	size_t rowPitch = 0;
+	int clError = 0;
+	auto mapped = static_cast<const uint8_t*>(queue.enqueueMapImage(image, CL_TRUE, CL_MAP_READ, cl::size_t<3>(), region, &rowPitch, nullptr,
+																	waitEvents, nullptr, &clError));
+	Logger::logOpenClError(clError, "map computed image");
+	error_quit_program(clError);
+	if (rowPitch == width) {
+		error = lodepng_encode_file(filename, mapped, width, height, LCT_GREY, 8);
+	} else {
+		// the encoder needs tightly packed rows
+		std::vector<uint8_t> pixels(width * height);
+		for (unsigned y = 0; y < height; ++y) {
+			std::copy(mapped + y * rowPitch, mapped + y * rowPitch + width, pixels.begin() + y * width);
+		}
+		error = lodepng::encode(filename, pixels, width, height, LCT_GREY, 8);
+	}
+	cl::Event unmapDone;
+	clError = queue.enqueueUnmapMemObject(image, const_cast<uint8_t*>(mapped), nullptr, &unmapDone);
+	Logger::logOpenClError(clError, "unmap computed image");
+	error_quit_program(clError);
+	unmapDone.wait();
+	Logger::logSave(error, filename);
+}
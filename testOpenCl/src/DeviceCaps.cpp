@@ -0,0 +1,247 @@
+#include "DeviceCaps.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include "ClUtils.hpp"
+
+
+namespace {
+
+std::map<cl_context, std::unique_ptr<ClUtils::DeviceCaps>> contextCaps;
+std::mutex contextCapsMutex;
+
+std::string toLower(std::string text) {
+	std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+	return text;
+}
+
+ClUtils::DeviceCaps queryCaps(const cl::Device& device, unsigned platformIndex, unsigned deviceIndex, const std::string& platformName) {
+	ClUtils::DeviceCaps caps;
+	caps.device = device;
+	caps.platformIndex = platformIndex;
+	caps.deviceIndex = deviceIndex;
+	caps.platformName = platformName;
+	caps.name = device.getInfo<CL_DEVICE_NAME>();
+	caps.type = device.getInfo<CL_DEVICE_TYPE>();
+	caps.computeUnits = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+	caps.clockMhz = device.getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+	caps.localMemSize = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	caps.dedicatedLocalMem = device.getInfo<CL_DEVICE_LOCAL_MEM_TYPE>() == CL_LOCAL;
+	caps.imageSupport = device.getInfo<CL_DEVICE_IMAGE_SUPPORT>() == CL_TRUE;
+	caps.maxAllocSize = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	caps.globalMemSize = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+	caps.maxWorkGroupSize = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+	caps.hostUnifiedMemory = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+	caps.halfImages = false;
+	caps.preferredFloatVectorWidth = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>();
+	caps.extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+	return caps;
+}
+
+// finds the platform and device index of a device as `enumerateDevices` numbers them, for a sub-device those of its root device
+void findIndices(const cl::Device& device, unsigned& platformIndex, unsigned& deviceIndex) {
+	cl_device_id root = device();
+	cl_device_id parent = device.getInfo<CL_DEVICE_PARENT_DEVICE>();
+	while (parent) {
+		root = parent;
+		// raw handles, a cl::Device would release the sub-devices it does not own
+		if (clGetDeviceInfo(root, CL_DEVICE_PARENT_DEVICE, sizeof(parent), &parent, nullptr) != CL_SUCCESS) {
+			parent = nullptr;
+		}
+	}
+	platformIndex = deviceIndex = 0;
+	std::vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+	for (unsigned p = 0; p < platforms.size(); ++p) {
+		std::vector<cl::Device> platformDevices;
+		platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &platformDevices);
+		for (unsigned d = 0; d < platformDevices.size(); ++d) {
+			if (platformDevices[d]() == root) {
+				platformIndex = p;
+				deviceIndex = d;
+				return;
+			}
+		}
+	}
+}
+
+const ClUtils::DeviceCaps* bestOf(const std::vector<const ClUtils::DeviceCaps*>& candidates) {
+	const ClUtils::DeviceCaps* best = nullptr;
+	for (const auto caps : candidates) {
+		if (!best || ClUtils::scoreDevice(*caps) > ClUtils::scoreDevice(*best)) {
+			best = caps;
+		}
+	}
+	return best;
+}
+
+// returns the devices matching the override, or all of them when the override matches nothing
+std::vector<const ClUtils::DeviceCaps*> filterDevices(const std::vector<ClUtils::DeviceCaps>& devices, const std::string& deviceOverride) {
+	std::vector<const ClUtils::DeviceCaps*> all, matching;
+	for (const auto& caps : devices) {
+		all.push_back(&caps);
+	}
+	if (deviceOverride.empty()) {
+		return all;
+	}
+
+	const auto wanted = toLower(deviceOverride);
+	unsigned platformIndex = 0, deviceIndex = 0;
+	char separator = 0;
+	std::istringstream indices(wanted);
+	const bool isIndexPair = (indices >> platformIndex >> separator >> deviceIndex) && separator == ':' && indices.eof();
+	for (const auto& caps : devices) {
+		bool match = false;
+		if (isIndexPair) {
+			match = caps.platformIndex == platformIndex && caps.deviceIndex == deviceIndex;
+		} else if (wanted == "cpu") {
+			match = (caps.type & CL_DEVICE_TYPE_CPU) != 0;
+		} else if (wanted == "gpu") {
+			match = (caps.type & CL_DEVICE_TYPE_GPU) != 0;
+		} else if (wanted == "accelerator") {
+			match = (caps.type & CL_DEVICE_TYPE_ACCELERATOR) != 0;
+		} else {
+			match = toLower(caps.name).find(wanted) != std::string::npos;
+		}
+		if (match) {
+			matching.push_back(&caps);
+		}
+	}
+	if (matching.empty()) {
+		std::cout << "No OpenCL device matches '" << deviceOverride << "', ignoring the override." << std::endl;
+		return all;
+	}
+	return matching;
+}
+
+// the override argument, or the environment variable if there is none
+std::string overrideOrEnvironment(const std::string& deviceOverride) {
+	const char* envOverride = std::getenv("DISPARITY_CL_DEVICE");
+	return deviceOverride.empty() && envOverride ? envOverride : deviceOverride;
+}
+
+}
+
+
+bool ClUtils::DeviceCaps::isCpu() const {
+	return (type & CL_DEVICE_TYPE_CPU) != 0;
+}
+
+
+bool ClUtils::DeviceCaps::hasExtension(const char* extension) const {
+	std::istringstream names(extensions);
+	std::string name;
+	while (names >> name) {
+		if (name == extension) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+std::vector<ClUtils::DeviceCaps> ClUtils::enumerateDevices() {
+	std::vector<DeviceCaps> devices;
+	std::vector<cl::Platform> platforms;
+	cl::Platform::get(&platforms);
+	for (unsigned p = 0; p < platforms.size(); ++p) {
+		const auto platformName = platforms[p].getInfo<CL_PLATFORM_NAME>();
+		std::vector<cl::Device> platformDevices;
+		platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &platformDevices);
+		for (unsigned d = 0; d < platformDevices.size(); ++d) {
+			devices.push_back(queryCaps(platformDevices[d], p, d, platformName));
+		}
+	}
+	return devices;
+}
+
+
+double ClUtils::scoreDevice(const DeviceCaps& caps) {
+	// every kernel of the pipeline reads images
+	if (!caps.imageSupport) {
+		return 0.0;
+	}
+	// a GPU compute unit runs many lanes, a CPU compute unit is one core with its SIMD width
+	const double lanes = caps.isCpu() ? std::max(caps.preferredFloatVectorWidth, 1u) : 16.0;
+	double score = caps.computeUnits * std::max(caps.clockMhz, 1u) * lanes;
+	// the disparity kernels tile their input in local memory
+	if (caps.dedicatedLocalMem) {
+		score *= 1.5;
+	}
+	score *= std::min(1.0, caps.localMemSize / (32.0 * 1024.0));
+	score *= std::min(1.0, caps.maxAllocSize / (256.0 * 1024.0 * 1024.0));
+	return score;
+}
+
+
+ClUtils::DeviceCaps ClUtils::selectDevice(const std::string& deviceOverride) {
+	const auto devices = enumerateDevices();
+	if (devices.empty()) {
+		std::cout << " No devices found. Check OpenCL installation!" << std::endl;
+		exit(1);
+	}
+	const std::string wanted = overrideOrEnvironment(deviceOverride);
+	for (const auto& caps : devices) {
+		std::cout << "Found device " << caps.platformIndex << ":" << caps.deviceIndex << " " << caps.name
+			<< " (" << caps.platformName << "), score: " << scoreDevice(caps) << std::endl;
+	}
+	return *bestOf(filterDevices(devices, wanted));
+}
+
+
+std::vector<ClUtils::DeviceCaps> ClUtils::matchingDevices(const std::string& deviceOverride) {
+	const auto devices = enumerateDevices();
+	std::vector<DeviceCaps> matching;
+	for (const auto caps : filterDevices(devices, overrideOrEnvironment(deviceOverride))) {
+		matching.push_back(*caps);
+	}
+	return matching;
+}
+
+
+const ClUtils::DeviceCaps& ClUtils::deviceCaps(const cl::Context& clCtx) {
+	std::lock_guard<std::mutex> lock(contextCapsMutex);
+	auto& caps = contextCaps[clCtx()];
+	if (!caps) {
+		const auto device = clCtx.getInfo<CL_CONTEXT_DEVICES>()[0];
+		const auto platformName = cl::Platform(device.getInfo<CL_DEVICE_PLATFORM>()).getInfo<CL_PLATFORM_NAME>();
+		unsigned platformIndex, deviceIndex;
+		findIndices(device, platformIndex, deviceIndex);
+		caps.reset(new DeviceCaps(queryCaps(device, platformIndex, deviceIndex, platformName)));
+		// the image formats are a property of the context
+		std::vector<cl::ImageFormat> formats;
+		clCtx.getSupportedImageFormats(CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D, &formats);
+		const auto supported = [&formats](cl_channel_order order) {
+			return std::any_of(formats.begin(), formats.end(), [order](const cl::ImageFormat& format) {
+				return format.image_channel_order == order && format.image_channel_data_type == CL_HALF_FLOAT;
+			});
+		};
+		caps->halfImages = supported(CL_R) && supported(CL_RG);
+	}
+	return *caps;
+}
+
+
+void ClUtils::releaseDeviceCaps(const cl::Context& clCtx) {
+	std::lock_guard<std::mutex> lock(contextCapsMutex);
+	contextCaps.erase(clCtx());
+}
+
+
+void ClUtils::logDeviceCaps(const DeviceCaps& caps) {
+	std::cout << "Using platform: " << caps.platformName << std::endl;
+	std::cout << "Using device: " << caps.name << std::endl;
+	std::cout << "CL_DEVICE_TYPE: " << (caps.isCpu() ? "CPU" : "GPU/accelerator") << std::endl;
+	std::cout << "CL_DEVICE_LOCAL_MEM_TYPE: " << (caps.dedicatedLocalMem ? "local" : "global") << std::endl;
+	std::cout << "CL_DEVICE_LOCAL_MEM_SIZE: " << caps.localMemSize << std::endl;
+	std::cout << "CL_DEVICE_MAX_COMPUTE_UNITS: " << caps.computeUnits << std::endl;
+	std::cout << "CL_DEVICE_MAX_CLOCK_FREQUENCY: " << caps.clockMhz << std::endl;
+	std::cout << "CL_DEVICE_MAX_MEM_ALLOC_SIZE: " << caps.maxAllocSize << std::endl;
+	std::cout << "CL_DEVICE_MAX_WORK_GROUP_SIZE: " << caps.maxWorkGroupSize << std::endl;
+}
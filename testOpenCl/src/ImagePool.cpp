@@ -0,0 +1,234 @@
+#include "ImagePool.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include "ClUtils.hpp"
+#include "Logger.hpp"
+
+
+namespace {
+
+std::map<cl_context, std::unique_ptr<ClUtils::ImagePool>> pools;
+std::mutex poolsMutex;
+
+size_t bytesPerPixel(const cl::ImageFormat& format) {
+	size_t channels = 1;
+	switch (format.image_channel_order) {
+	case CL_RG: channels = 2; break;
+	case CL_RGBA: channels = 4; break;
+	default: break;
+	}
+	size_t channelBytes = 4;
+	switch (format.image_channel_data_type) {
+	case CL_UNORM_INT8:
+	case CL_UNSIGNED_INT8: channelBytes = 1; break;
+	case CL_UNSIGNED_INT16:
+	case CL_HALF_FLOAT: channelBytes = 2; break;
+	default: break;
+	}
+	return channels * channelBytes;
+}
+
+bool completed(const std::vector<cl::Event>& events) {
+	for (const auto& event : events) {
+		// failed commands (negative status) do not use the image any more either
+		if (event() && event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() > CL_COMPLETE) {
+			return false;
+		}
+	}
+	return true;
+}
+
+}
+
+
+ClUtils::ImagePool& ClUtils::ImagePool::forContext(const cl::Context& clCtx) {
+	std::lock_guard<std::mutex> lock(poolsMutex);
+	auto& pool = pools[clCtx()];
+	if (!pool) {
+		pool.reset(new ImagePool(clCtx));
+	}
+	return *pool;
+}
+
+
+void ClUtils::ImagePool::release(const cl::Context& clCtx) {
+	// the images are released after the lock, when `pool` goes out of scope
+	std::unique_ptr<ImagePool> pool;
+	{
+		std::lock_guard<std::mutex> lock(poolsMutex);
+		auto it = pools.find(clCtx());
+		if (it == pools.end()) {
+			return;
+		}
+		pool = std::move(it->second);
+		pools.erase(it);
+	}
+}
+
+
+ClUtils::ImagePool::ImagePool(const cl::Context& clCtx)
+	: m_context(clCtx), m_currentBytes(0), m_peakBytes(0), m_pooledBytes(0), m_freeBytes(0), m_freeBytesLimit(256 << 20),
+	m_releases(0), m_allocations(0), m_reuses(0) {
+}
+
+
+cl::Image2D ClUtils::ImagePool::acquire(cl_mem_flags flags, const cl::ImageFormat& format, unsigned width, unsigned height) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const Key key(flags, format.image_channel_order, format.image_channel_data_type, width, height);
+	cl::Image2D image;
+	if (reuse(m_freeImages, key, image)) {
+		return image;
+	}
+
+	int clError = 0;
+	image = cl::Image2D(m_context, flags, format, width, height, 0, nullptr, &clError);
+	Logger::logOpenClError(clError, "create OpenCL image");
+	error_quit_program(clError);
+	allocated(image(), key, width * height * bytesPerPixel(format));
+	return image;
+}
+
+
+void ClUtils::ImagePool::release(const cl::Image2D& image, const std::vector<cl::Event>& lastUses) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	putBack(m_freeImages, image, lastUses);
+}
+
+
+cl::Buffer ClUtils::ImagePool::acquireBuffer(cl_mem_flags flags, size_t bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const Key key(flags, 0, 0, bytes, 0);
+	cl::Buffer buffer;
+	if (reuse(m_freeBuffers, key, buffer)) {
+		return buffer;
+	}
+
+	int clError = 0;
+	buffer = cl::Buffer(m_context, flags, bytes, nullptr, &clError);
+	Logger::logOpenClError(clError, "create OpenCL buffer");
+	error_quit_program(clError);
+	allocated(buffer(), key, bytes);
+	return buffer;
+}
+
+
+void ClUtils::ImagePool::release(const cl::Buffer& buffer, const std::vector<cl::Event>& lastUses) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	putBack(m_freeBuffers, buffer, lastUses);
+}
+
+
+template <typename Memory>
+bool ClUtils::ImagePool::reuse(std::multimap<Key, Memory>& free, const Key& key, Memory& memory) {
+	const auto range = free.equal_range(key);
+	for (auto it = range.first; it != range.second; ++it) {
+		auto& entry = m_entries[it->second()];
+		if (completed(entry.lastUses)) {
+			memory = it->second;
+			free.erase(it);
+			entry.inUse = true;
+			entry.lastUses.clear();
+			m_freeBytes -= entry.bytes;
+			m_currentBytes += entry.bytes;
+			m_peakBytes = std::max(m_peakBytes, m_currentBytes);
+			++m_reuses;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void ClUtils::ImagePool::allocated(cl_mem memory, const Key& key, size_t bytes) {
+	m_entries[memory] = {key, bytes, true, 0, {}};
+	m_currentBytes += bytes;
+	m_peakBytes = std::max(m_peakBytes, m_currentBytes);
+	m_pooledBytes += bytes;
+	++m_allocations;
+}
+
+
+template <typename Memory>
+void ClUtils::ImagePool::putBack(std::multimap<Key, Memory>& free, const Memory& memory, const std::vector<cl::Event>& lastUses) {
+	auto it = m_entries.find(memory());
+	if (it == m_entries.end() || !it->second.inUse) {
+		// not allocated by the pool, or released twice
+		return;
+	}
+	it->second.inUse = false;
+	it->second.releaseOrder = ++m_releases;
+	it->second.lastUses = lastUses;
+	m_currentBytes -= it->second.bytes;
+	m_freeBytes += it->second.bytes;
+	free.insert(std::make_pair(it->second.key, memory));
+	trim();
+}
+
+
+void ClUtils::ImagePool::setFreeBytesLimit(size_t bytes) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_freeBytesLimit = bytes;
+	trim();
+}
+
+
+void ClUtils::ImagePool::trim() {
+	const auto oldestOf = [this](auto& free) {
+		auto oldest = free.begin();
+		for (auto it = free.begin(); it != free.end(); ++it) {
+			if (m_entries[it->second()].releaseOrder < m_entries[oldest->second()].releaseOrder) {
+				oldest = it;
+			}
+		}
+		return oldest;
+	};
+	while (m_freeBytes > m_freeBytesLimit && (!m_freeImages.empty() || !m_freeBuffers.empty())) {
+		const auto oldestImage = oldestOf(m_freeImages);
+		const auto oldestBuffer = oldestOf(m_freeBuffers);
+		const bool image = oldestBuffer == m_freeBuffers.end() || (oldestImage != m_freeImages.end()
+			&& m_entries[oldestImage->second()].releaseOrder < m_entries[oldestBuffer->second()].releaseOrder);
+		const auto entry = m_entries.find(image ? oldestImage->second() : oldestBuffer->second());
+		m_freeBytes -= entry->second.bytes;
+		m_pooledBytes -= entry->second.bytes;
+		m_entries.erase(entry);
+		if (image) {
+			m_freeImages.erase(oldestImage);
+		} else {
+			m_freeBuffers.erase(oldestBuffer);
+		}
+	}
+}
+
+
+size_t ClUtils::ImagePool::currentBytes() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_currentBytes;
+}
+
+
+size_t ClUtils::ImagePool::peakBytes() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_peakBytes;
+}
+
+
+size_t ClUtils::ImagePool::pooledBytes() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pooledBytes;
+}
+
+
+unsigned ClUtils::ImagePool::allocations() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_allocations;
+}
+
+
+void ClUtils::ImagePool::logStats() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::cout << "OpenCL image pool: " << m_allocations << " allocations, " << m_reuses << " reuses, "
+		<< m_currentBytes / 1024 << " KiB in use, " << m_peakBytes / 1024 << " KiB peak in use, " << m_pooledBytes / 1024 << " KiB pooled, "
+		<< m_freeImages.size() + m_freeBuffers.size() << " of " << m_entries.size() << " images and buffers free" << std::endl;
+}
@@ -0,0 +1,206 @@
+#include "MultiDevice.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include "ImagePool.hpp"
+#include "Logger.hpp"
+#include "ProgramCache.hpp"
+
+
+ClUtils::MultiDeviceExecutor::MultiDeviceExecutor(const std::vector<DeviceCaps>& devices, const DisparityParams& params, bool splitNuma)
+	: m_params(params) {
+	// a band of gray rows has to start on an input row, which needs a whole downscale factor
+	m_params.downscale = std::max(1.f, std::round(params.downscale));
+	double totalScore = 0.0;
+	std::vector<double> scores;
+	for (const auto& caps : devices) {
+		if (!caps.imageSupport) {
+			continue;
+		}
+		std::vector<cl::Device> targets;
+		if (splitNuma && caps.isCpu()) {
+			const cl_device_partition_property properties[] = {
+				CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+			};
+			cl::Device device = caps.device;
+			if (device.createSubDevices(properties, &targets) != CL_SUCCESS || targets.size() < 2) {
+				targets.clear();
+			}
+		}
+		if (targets.empty()) {
+			targets.push_back(caps.device);
+		}
+
+		for (size_t i = 0; i < targets.size(); ++i) {
+			Worker worker;
+			worker.name = targets.size() > 1 ? caps.name + " [NUMA node " + std::to_string(i) + "]" : caps.name;
+			worker.context = cl::Context({targets[i]});
+			worker.queue = createQueue(worker.context);
+			worker.params = m_params.fitToDevice(deviceCaps(worker.context));
+			worker.rowsPerSecond = 0.0;
+			worker.share = 0.0;
+			m_workers.push_back(worker);
+			scores.push_back(std::max(scoreDevice(deviceCaps(worker.context)), 1.0));
+			totalScore += scores.back();
+		}
+	}
+	if (m_workers.empty()) {
+		std::cout << "no OpenCL devices given to the multi-device executor" << std::endl;
+		error_quit_program(1);
+	}
+
+	// until the first pair is measured, the device scores guess the throughput
+	for (size_t i = 0; i < m_workers.size(); ++i) {
+		m_workers[i].share = scores[i] / totalScore;
+	}
+}
+
+
+ClUtils::MultiDeviceExecutor::~MultiDeviceExecutor() {
+	for (const auto& worker : m_workers) {
+		ProgramCache::release(worker.context);
+		ImagePool::release(worker.context);
+		releaseDeviceCaps(worker.context);
+	}
+}
+
+
+std::vector<uint8_t> ClUtils::MultiDeviceExecutor::computeDisparity(const std::vector<uint8_t>& pixelsL, const std::vector<uint8_t>& pixelsR,
+																	unsigned width, unsigned height, unsigned& outWidth, unsigned& outHeight) {
+	const unsigned downscale = static_cast<unsigned>(m_params.downscale);
+	outWidth = width / downscale;
+	outHeight = height / downscale;
+	const unsigned halo = m_params.window / 2;
+	const size_t inputRowBytes = width * 4 * downscale;
+
+	// band boundaries in disparity map rows, every device gets at least one row so it can be measured
+	const unsigned workerCount = static_cast<unsigned>(m_workers.size());
+	const unsigned minRows = outHeight >= workerCount ? 1 : 0;
+	std::vector<unsigned> first(workerCount + 1, 0);
+	double cumulativeShare = 0.0;
+	for (unsigned i = 0; i < workerCount; ++i) {
+		cumulativeShare += m_workers[i].share;
+		const unsigned rowsLeftForOthers = minRows * (workerCount - 1 - i);
+		unsigned boundary = static_cast<unsigned>(std::lround(cumulativeShare * outHeight));
+		boundary = std::max(boundary, first[i] + minRows);
+		boundary = std::min(boundary, outHeight - rowsLeftForOthers);
+		first[i + 1] = i + 1 == workerCount ? outHeight : boundary;
+	}
+
+	// enqueue every band, each computing its rows of the cross-checked map
+	std::vector<uint8_t> checkedPixels(outWidth * outHeight);
+	std::vector<unsigned> bandRows(m_workers.size(), 0);
+	std::vector<cl::Event> startEvents(m_workers.size()), readEvents(m_workers.size());
+	m_bandPixels.resize(2 * m_workers.size());
+	for (size_t i = 0; i < m_workers.size(); ++i) {
+		if (first[i + 1] == first[i]) {
+			continue;
+		}
+		auto& worker = m_workers[i];
+		const unsigned top = first[i] >= halo ? first[i] - halo : 0;
+		const unsigned bottom = std::min(outHeight, first[i + 1] + halo);
+		const unsigned bandHeight = bottom - top;
+		bandRows[i] = bandHeight;
+
+		// the bands are uploaded asynchronously, their host copies live until the reads below complete
+		auto& bandL = m_bandPixels[2 * i];
+		auto& bandR = m_bandPixels[2 * i + 1];
+		bandL.assign(pixelsL.begin() + top * inputRowBytes, pixelsL.begin() + bottom * inputRowBytes);
+		bandR.assign(pixelsR.begin() + top * inputRowBytes, pixelsR.begin() + bottom * inputRowBytes);
+
+		int clError = worker.queue.enqueueMarkerWithWaitList(nullptr, &startEvents[i]);
+		Logger::logOpenClError(clError, "enqueue band start marker");
+		auto left = precalcImage(worker.context, worker.queue, bandL, width, bandHeight * downscale, worker.params);
+		auto right = precalcImage(worker.context, worker.queue, bandR, width, bandHeight * downscale, worker.params);
+		std::vector<cl::Event> dispDone(2);
+		auto dispL = calculateDisparityMap(worker.context, worker.queue, left, right, false, worker.params, &dispDone[0]);
+		auto dispR = calculateDisparityMap(worker.context, worker.queue, right, left, true, worker.params, &dispDone[1]);
+		releasePrecalcImage(worker.context, left, dispDone);
+		releasePrecalcImage(worker.context, right, dispDone);
+		std::vector<cl::Event> checkDone(1);
+		auto checked = crossCheck(worker.context, worker.queue, dispL, dispR, outWidth, bandHeight, worker.params, &dispDone, &checkDone[0]);
+		releaseImage(worker.context, dispL, checkDone);
+		releaseImage(worker.context, dispR, checkDone);
+
+		// only the rows owned by the band are read back, the halo rows belong to the neighbours
+		cl::size_t<3> origin, region;
+		origin[1] = first[i] - top;
+		region[0] = outWidth;
+		region[1] = first[i + 1] - first[i];
+		region[2] = 1;
+		clError = worker.queue.enqueueReadImage(checked, CL_FALSE, origin, region, outWidth, 0,
+												checkedPixels.data() + first[i] * outWidth, &checkDone, &readEvents[i]);
+		Logger::logOpenClError(clError, "read band of cross-checked image");
+		error_quit_program(clError);
+		releaseImage(worker.context, checked, {readEvents[i]});
+		worker.queue.flush();
+	}
+
+	std::vector<double> seconds(m_workers.size(), 0.0);
+	for (size_t i = 0; i < m_workers.size(); ++i) {
+		if (bandRows[i] == 0) {
+			continue;
+		}
+		readEvents[i].wait();
+		const cl_ulong start = startEvents[i].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+		const cl_ulong end = readEvents[i].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+		seconds[i] = (end - start) / 1e9;
+	}
+	rebalance(bandRows, seconds);
+
+	// the occlusion fill looks far beyond the band halo, so it runs on the stitched map
+	auto& primary = m_workers.front();
+	auto checkedImg = createGrayClImage(primary.context, outWidth, outHeight, CL_UNSIGNED_INT8);
+	cl::size_t<3> region;
+	region[0] = outWidth;
+	region[1] = outHeight;
+	region[2] = 1;
+	std::vector<cl::Event> uploadDone(1);
+	int clError = primary.queue.enqueueWriteImage(checkedImg, CL_FALSE, cl::size_t<3>(), region, 0, 0, checkedPixels.data(), nullptr, &uploadDone[0]);
+	Logger::logOpenClError(clError, "upload stitched cross-checked image");
+	error_quit_program(clError);
+	std::vector<cl::Event> fillDone(1);
+	auto outImg = fillOcclusions(primary.context, primary.queue, checkedImg, outWidth, outHeight, primary.params, &uploadDone, &fillDone[0]);
+	releaseImage(primary.context, checkedImg, fillDone);
+	auto pixels = readGrayImage(primary.queue, outImg, outWidth, outHeight, &fillDone);
+	releaseImage(primary.context, outImg, {});
+	return pixels;
+}
+
+
+void ClUtils::MultiDeviceExecutor::logBalance() const {
+	for (const auto& worker : m_workers) {
+		std::cout << "device: " << worker.name << " rows/s: " << worker.rowsPerSecond << " band share: " << worker.share * 100.0 << "%" << std::endl;
+	}
+}
+
+
+size_t ClUtils::MultiDeviceExecutor::workerCount() const {
+	return m_workers.size();
+}
+
+
+void ClUtils::MultiDeviceExecutor::rebalance(const std::vector<unsigned>& rows, const std::vector<double>& seconds) {
+	for (size_t i = 0; i < m_workers.size(); ++i) {
+		if (rows[i] == 0 || seconds[i] <= 0.0) {
+			continue;
+		}
+		// smooth the measurement, a single pair is a noisy sample
+		const double measured = rows[i] / seconds[i];
+		auto& worker = m_workers[i];
+		worker.rowsPerSecond = worker.rowsPerSecond > 0.0 ? 0.5 * worker.rowsPerSecond + 0.5 * measured : measured;
+	}
+
+	double total = 0.0;
+	for (const auto& worker : m_workers) {
+		if (worker.rowsPerSecond <= 0.0) {
+			// keep the initial guess until every device has been measured
+			return;
+		}
+		total += worker.rowsPerSecond;
+	}
+	for (auto& worker : m_workers) {
+		worker.share = worker.rowsPerSecond / total;
+	}
+}
@@ -0,0 +1,324 @@
+#include "ProgramCache.hpp"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "ClUtils.hpp"
+#include "Logger.hpp"
+
+
+namespace {
+
+std::map<cl_context, std::unique_ptr<ClUtils::ProgramCache>> caches;
+std::mutex cachesMutex;
+
+const char* binaryMagic = "DCLB";
+
+std::string initialBinaryCacheDirectory() {
+	const char* dir = std::getenv("DISPARITY_CL_CACHE");
+	return dir ? dir : "clcache";
+}
+
+std::string binaryCacheDirectory = initialBinaryCacheDirectory();
+
+// 64 bit FNV-1a hash, stable across runs and compilers
+void hashAppend(uint64_t& hash, const std::string& text) {
+	for (const unsigned char c : text) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	// separator, so that ("ab", "c") and ("a", "bc") differ
+	hash ^= 0xff;
+	hash *= 1099511628211ull;
+}
+
+// a file name next to the path no other process or thread writes to
+std::string temporaryPath(const std::string& path) {
+#ifdef _WIN32
+	const int pid = _getpid();
+#else
+	const int pid = getpid();
+#endif
+	std::ostringstream temporary;
+	temporary << path << ".tmp" << pid << "_" << std::hash<std::thread::id>()(std::this_thread::get_id());
+	return temporary.str();
+}
+
+void makeDirectory(const std::string& path) {
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+}
+
+
+ClUtils::ProgramCache& ClUtils::ProgramCache::forContext(const cl::Context& clCtx) {
+	std::lock_guard<std::mutex> lock(cachesMutex);
+	auto& cache = caches[clCtx()];
+	if (!cache) {
+		cache.reset(new ProgramCache(clCtx));
+	}
+	return *cache;
+}
+
+
+void ClUtils::ProgramCache::release(const cl::Context& clCtx) {
+	// the programs and kernels are released after the lock, when `cache` goes out of scope
+	std::unique_ptr<ProgramCache> cache;
+	{
+		std::lock_guard<std::mutex> lock(cachesMutex);
+		auto it = caches.find(clCtx());
+		if (it == caches.end()) {
+			return;
+		}
+		cache = std::move(it->second);
+		caches.erase(it);
+	}
+}
+
+
+void ClUtils::ProgramCache::setBinaryCacheDirectory(const std::string& directory) {
+	std::lock_guard<std::mutex> lock(cachesMutex);
+	binaryCacheDirectory = directory;
+}
+
+
+ClUtils::ProgramCache::ProgramCache(const cl::Context& clCtx) : m_context(clCtx), m_hits(0), m_misses(0), m_builds(0), m_binaryHits(0) {
+}
+
+
+cl::Kernel ClUtils::ProgramCache::kernel(const char* filename, const char* kernelname, const std::string& options) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const KernelKey key(filename, kernelname, options);
+	auto it = m_kernels.find(key);
+	if (it != m_kernels.end()) {
+		++m_hits;
+		return it->second;
+	}
+
+	++m_misses;
+	int clError = 0;
+	cl::Kernel kernel(program(filename, options), kernelname, &clError);
+	Logger::logOpenClError(clError, filename);
+	error_quit_program(clError);
+	m_kernels[key] = kernel;
+	return kernel;
+}
+
+
+cl::Kernel ClUtils::ProgramCache::cloneKernel(const char* filename, const char* kernelname, const std::string& options) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	int clError = 0;
+	cl::Kernel kernel(program(filename, options), kernelname, &clError);
+	Logger::logOpenClError(clError, filename);
+	error_quit_program(clError);
+	return kernel;
+}
+
+
+unsigned ClUtils::ProgramCache::hits() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_hits;
+}
+
+
+unsigned ClUtils::ProgramCache::misses() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_misses;
+}
+
+
+unsigned ClUtils::ProgramCache::builds() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_builds;
+}
+
+
+unsigned ClUtils::ProgramCache::binaryHits() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_binaryHits;
+}
+
+
+void ClUtils::ProgramCache::logStats() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::cout << "OpenCL program cache: " << m_hits << " kernel hits, " << m_misses << " kernel misses, "
+		<< m_builds << " program builds, " << m_binaryHits << " of them loaded from binary cache, "
+		<< m_programs.size() << " programs, " << m_kernels.size() << " kernels" << std::endl;
+}
+
+
+cl::Program ClUtils::ProgramCache::program(const std::string& filename, const std::string& options) {
+	const ProgramKey key(filename, options);
+	auto it = m_programs.find(key);
+	if (it != m_programs.end()) {
+		return it->second;
+	}
+
+	++m_builds;
+	auto programText = readFile(filename.c_str());
+	const auto path = binaryPath(programText, options);
+	cl::Program program;
+	if (!path.empty() && loadBinary(path, options, program)) {
+		++m_binaryHits;
+		m_programs[key] = program;
+		return program;
+	}
+
+	program = cl::Program(m_context, programText);
+	int clError = program.build(options.c_str());
+	Logger::logOpenClError(clError, "build cl program");
+	if (clError) {
+		for (const auto& device : m_context.getInfo<CL_CONTEXT_DEVICES>()) {
+			std::cout << filename << " build log:" << std::endl << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+		}
+	}
+	error_quit_program(clError);
+	if (!path.empty()) {
+		storeBinary(path, program);
+	}
+	m_programs[key] = program;
+	return program;
+}
+
+
+std::string ClUtils::ProgramCache::binaryPath(const std::string& source, const std::string& options) const {
+	std::string directory;
+	{
+		std::lock_guard<std::mutex> lock(cachesMutex);
+		directory = binaryCacheDirectory;
+	}
+	if (directory.empty()) {
+		return "";
+	}
+
+	uint64_t hash = 14695981039346656037ull;
+	for (const auto& device : m_context.getInfo<CL_CONTEXT_DEVICES>()) {
+		hashAppend(hash, device.getInfo<CL_DEVICE_NAME>());
+		hashAppend(hash, device.getInfo<CL_DRIVER_VERSION>());
+	}
+	hashAppend(hash, source);
+	// the kernels include this header, so its constants are part of the program
+	hashAppend(hash, readFile("clIncludes.h"));
+	hashAppend(hash, options);
+
+	std::ostringstream path;
+	path << directory << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+	return path.str();
+}
+
+
+bool ClUtils::ProgramCache::loadBinary(const std::string& path, const std::string& options, cl::Program& program) const {
+	std::ifstream file(path, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	char magic[4] = {};
+	uint32_t count = 0;
+	file.read(magic, sizeof(magic));
+	file.read(reinterpret_cast<char*>(&count), sizeof(count));
+	const auto devices = m_context.getInfo<CL_CONTEXT_DEVICES>();
+	if (!file || std::string(magic, sizeof(magic)) != binaryMagic || count != devices.size()) {
+		return false;
+	}
+
+	std::vector<std::vector<char>> data(count);
+	cl::Program::Binaries binaries;
+	for (auto& binary : data) {
+		uint64_t size = 0;
+		file.read(reinterpret_cast<char*>(&size), sizeof(size));
+		binary.resize(static_cast<size_t>(size));
+		file.read(binary.data(), binary.size());
+		if (!file || binary.empty()) {
+			return false;
+		}
+		binaries.push_back(std::make_pair(binary.data(), binary.size()));
+	}
+
+	// a stale or rejected binary is not an error, the caller falls back to the source build
+	int clError = 0;
+	std::vector<cl_int> binaryStatus;
+	cl::Program binaryProgram(m_context, devices, binaries, &binaryStatus, &clError);
+	if (clError) {
+		return false;
+	}
+	for (const auto status : binaryStatus) {
+		if (status != CL_SUCCESS) {
+			return false;
+		}
+	}
+	if (binaryProgram.build(devices, options.c_str())) {
+		return false;
+	}
+	program = binaryProgram;
+	return true;
+}
+
+
+void ClUtils::ProgramCache::storeBinary(const std::string& path, const cl::Program& program) const {
+	const auto devices = m_context.getInfo<CL_CONTEXT_DEVICES>();
+	std::vector<size_t> sizes(devices.size());
+	int clError = clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizes.size() * sizeof(size_t), sizes.data(), nullptr);
+	Logger::logOpenClError(clError, "query program binary sizes");
+	if (clError) {
+		return;
+	}
+
+	std::vector<std::vector<unsigned char>> data(devices.size());
+	std::vector<unsigned char*> pointers(devices.size());
+	for (size_t i = 0; i < devices.size(); ++i) {
+		data[i].resize(sizes[i]);
+		pointers[i] = data[i].data();
+	}
+	clError = clGetProgramInfo(program(), CL_PROGRAM_BINARIES, pointers.size() * sizeof(unsigned char*), pointers.data(), nullptr);
+	Logger::logOpenClError(clError, "query program binaries");
+	if (clError) {
+		return;
+	}
+
+	makeDirectory(path.substr(0, path.find_last_of('/')));
+	// written under a temporary name and renamed into place, so other processes sharing the cache directory
+	// never read a partly written binary
+	const auto temporary = temporaryPath(path);
+	{
+		std::ofstream file(temporary, std::ios::binary);
+		const uint32_t count = static_cast<uint32_t>(data.size());
+		file.write(binaryMagic, 4);
+		file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+		for (const auto& binary : data) {
+			const uint64_t size = binary.size();
+			file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+			file.write(reinterpret_cast<const char*>(binary.data()), binary.size());
+		}
+		file.close();
+		if (!file) {
+			std::cout << "could not write OpenCL program binary: " << path << std::endl;
+			std::error_code error;
+			std::filesystem::remove(temporary, error);
+			return;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(temporary, path, error);
+	if (error) {
+		std::cout << "could not write OpenCL program binary: " << path << ": " << error.message() << std::endl;
+		std::filesystem::remove(temporary, error);
+	}
+}
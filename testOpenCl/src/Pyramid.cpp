@@ -0,0 +1,131 @@
+#include "Pyramid.hpp"
+
+#include <string>
+#include "Logger.hpp"
+
+
+namespace {
+
+// every kernel of pyramid.cl uses the same options, so the file is built once
+std::string pyramidOptions(const ClUtils::DisparityParams& params) {
+	return params.buildOptions() + " -D REFINE_RANGE=" + std::to_string(params.refineRange);
+}
+
+}
+
+
+std::vector<ClUtils::PrecalcImage> ClUtils::precalcPyramid(const cl::Context& clCtx, const cl::CommandQueue& queue, const cl::Image2D& input,
+															unsigned width, unsigned height, const DisparityParams& params,
+															const std::vector<cl::Event>* waitEvents) {
+	std::vector<PrecalcImage> levels;
+	auto gray = createGrayClImage(clCtx, width, height, params.imageType());
+	auto grayKernel = loadKernel(clCtx, "pyramid.cl", "toGray", pyramidOptions(params));
+	grayKernel.setArg(0, input);
+	grayKernel.setArg(1, gray);
+	auto grayDone = runKernel(queue, grayKernel, cl::NDRange(width, height), "pyramid gray kernel", cl::NullRange, waitEvents);
+	levels.push_back(windowStatistics(clCtx, queue, gray, width, height, params, grayDone));
+
+	for (unsigned level = 1; level < params.pyramidLevels; ++level) {
+		const unsigned levelWidth = width >> level;
+		const unsigned levelHeight = height >> level;
+		auto coarser = createGrayClImage(clCtx, levelWidth, levelHeight, params.imageType());
+		auto downKernel = loadKernel(clCtx, "pyramid.cl", "pyrDown", pyramidOptions(params));
+		downKernel.setArg(0, gray);
+		downKernel.setArg(1, coarser);
+		const std::vector<cl::Event> downWait{grayDone};
+		grayDone = runKernel(queue, downKernel, cl::NDRange(levelWidth, levelHeight), "pyrDown kernel", cl::NullRange, &downWait);
+		gray = coarser;
+		levels.push_back(windowStatistics(clCtx, queue, gray, levelWidth, levelHeight, params, grayDone));
+	}
+	return levels;
+}
+
+
+cl::Image2D ClUtils::pyramidDisparityMap(const cl::Context& clCtx, const cl::CommandQueue& queue, const std::vector<PrecalcImage>& left,
+										const std::vector<PrecalcImage>& right, bool invertD, const DisparityParams& params, cl::Event* event) {
+	// exhaustive search at the coarsest level, in pixels of that level
+	const auto& coarsest = left.back();
+	DisparityParams rawParams = params;
+	rawParams.temporalRange = 0;
+	auto coarse = createGrayClImage(clCtx, coarsest.width, coarsest.height, CL_UNSIGNED_INT16);
+	auto searchKernel = loadKernel(clCtx, "disparity.cl", "disparity", rawParams.buildOptions() + " -D RAW_DISPARITY");
+	searchKernel.setArg(0, coarse);
+	searchKernel.setArg(1, coarsest.grayImg);
+	searchKernel.setArg(2, right.back().grayImg);
+	searchKernel.setArg(3, coarsest.stats);
+	searchKernel.setArg(4, right.back().stats);
+	searchKernel.setArg(5, invertD ? 1 : 0);
+	std::vector<cl::Event> waitEvents{coarsest.ready, right.back().ready};
+	const cl::NDRange globalRange(roundUp(coarsest.width, params.groupWidth), roundUp(coarsest.height, params.groupHeight));
+	auto done = runKernel(queue, searchKernel, globalRange, "pyramid search kernel", cl::NDRange(params.groupWidth, params.groupHeight), &waitEvents);
+
+	// refine level by level, the range doubles with the resolution
+	unsigned maxDisp = params.maxDisp;
+	for (size_t level = left.size() - 1; level-- > 0;) {
+		maxDisp *= 2;
+		auto finer = createGrayClImage(clCtx, left[level].width, left[level].height, CL_UNSIGNED_INT16);
+		auto refineKernel = loadKernel(clCtx, "pyramid.cl", "refineDisparity", pyramidOptions(params));
+		refineKernel.setArg(0, finer);
+		refineKernel.setArg(1, left[level].grayImg);
+		refineKernel.setArg(2, right[level].grayImg);
+		refineKernel.setArg(3, left[level].means);
+		refineKernel.setArg(4, right[level].means);
+		refineKernel.setArg(5, left[level].stdDev);
+		refineKernel.setArg(6, right[level].stdDev);
+		refineKernel.setArg(7, coarse);
+		refineKernel.setArg(8, invertD ? 1 : 0);
+		refineKernel.setArg(9, static_cast<int>(maxDisp));
+		waitEvents = {done, left[level].ready, right[level].ready};
+		done = runKernel(queue, refineKernel, cl::NDRange(left[level].width, left[level].height), "refine disparity kernel", cl::NullRange, &waitEvents);
+		releaseImage(clCtx, coarse, {done});
+		coarse = finer;
+	}
+
+	// the 8 bit map the cross-check and the occlusion fill work on
+	auto outImg = createGrayClImage(clCtx, left.front().width, left.front().height, CL_UNSIGNED_INT8);
+	auto scaleKernel = loadKernel(clCtx, "pyramid.cl", "scaleDisparity", pyramidOptions(params));
+	scaleKernel.setArg(0, outImg);
+	scaleKernel.setArg(1, coarse);
+	scaleKernel.setArg(2, static_cast<int>(maxDisp));
+	waitEvents = {done};
+	done = runKernel(queue, scaleKernel, cl::NDRange(left.front().width, left.front().height), "scale disparity kernel", cl::NullRange, &waitEvents);
+	releaseImage(clCtx, coarse, {done});
+	if (event) {
+		*event = done;
+	}
+	return outImg;
+}
+
+
+ClUtils::DisparityResult ClUtils::computePyramidDisparity(const cl::Context& clCtx, const cl::CommandQueue& leftQueue, const cl::CommandQueue& rightQueue,
+														std::vector<uint8_t>& pixelsL, std::vector<uint8_t>& pixelsR, unsigned width, unsigned height,
+														const DisparityParams& params) {
+	std::vector<cl::Event> uploadL, uploadR;
+	auto inputL = uploadInputImage(clCtx, leftQueue, pixelsL, width, height, uploadL);
+	auto inputR = uploadInputImage(clCtx, rightQueue, pixelsR, width, height, uploadR);
+	auto pyramidL = precalcPyramid(clCtx, leftQueue, inputL, width, height, params, &uploadL);
+	auto pyramidR = precalcPyramid(clCtx, rightQueue, inputR, width, height, params, &uploadR);
+	releaseImage(clCtx, inputL, {pyramidL.front().ready});
+	releaseImage(clCtx, inputR, {pyramidR.front().ready});
+	leftQueue.flush();
+	rightQueue.flush();
+
+	std::vector<cl::Event> dispDone(2);
+	auto dispL = pyramidDisparityMap(clCtx, leftQueue, pyramidL, pyramidR, false, params, &dispDone[0]);
+	auto dispR = pyramidDisparityMap(clCtx, rightQueue, pyramidR, pyramidL, true, params, &dispDone[1]);
+	rightQueue.flush();
+	for (size_t level = 0; level < pyramidL.size(); ++level) {
+		releasePrecalcImage(clCtx, pyramidL[level], dispDone);
+		releasePrecalcImage(clCtx, pyramidR[level], dispDone);
+	}
+
+	std::vector<cl::Event> crossCheckDone(1);
+	auto crossCheckImg = crossCheck(clCtx, leftQueue, dispL, dispR, width, height, params, &dispDone, &crossCheckDone[0]);
+	releaseImage(clCtx, dispL, crossCheckDone);
+	releaseImage(clCtx, dispR, crossCheckDone);
+	cl::Event occlusionDone;
+	auto outImg = fillOcclusions(clCtx, leftQueue, crossCheckImg, width, height, params, &crossCheckDone, &occlusionDone);
+	releaseImage(clCtx, crossCheckImg, {occlusionDone});
+	leftQueue.flush();
+	return {width, height, outImg, occlusionDone};
+}
@@ -0,0 +1,116 @@
+#include "StreamEngine.hpp"
+
+#include <algorithm>
+#include "DeviceCaps.hpp"
+#include "Logger.hpp"
+
+
+ClUtils::StreamEngine::StreamEngine(const cl::Context& clCtx, const DisparityParams& params, unsigned depth)
+	: m_context(clCtx), m_uploadQueue(createQueue(clCtx)), m_transferQueue(createQueue(clCtx)), m_leftQueue(createQueue(clCtx)), m_rightQueue(createQueue(clCtx)),
+	m_params(params.fitToDevice(deviceCaps(clCtx))), m_slots(std::max(depth, 1u)), m_head(0), m_tail(0), m_inFlight(0) {
+	for (auto& slot : m_slots) {
+		slot.owner = this;
+		slot.width = slot.height = 0;
+		slot.outWidth = slot.outHeight = 0;
+		slot.busy = false;
+		slot.readBack = false;
+		slot.failed = false;
+	}
+}
+
+
+ClUtils::StreamEngine::~StreamEngine() {
+	// the readback callbacks use the slots, so they must all have run
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_changed.wait(lock, [this]() {
+		return std::none_of(m_slots.begin(), m_slots.end(), [](const Slot& slot) { return slot.busy && !slot.readBack; });
+	});
+	releaseTemporalState(m_context, m_temporal);
+}
+
+
+void ClUtils::StreamEngine::pushFrame(std::vector<uint8_t>& pixelsL, std::vector<uint8_t>& pixelsR, unsigned width, unsigned height) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_changed.wait(lock, [this]() { return !m_slots[m_head].busy; });
+	Slot& slot = m_slots[m_head];
+	slot.busy = true;
+	slot.readBack = false;
+	slot.failed = false;
+	m_head = (m_head + 1) % m_slots.size();
+	++m_inFlight;
+	lock.unlock();
+
+	// the previous frame of the slot is fully read back, so its buffers can go back to the caller
+	slot.pixelsL.swap(pixelsL);
+	slot.pixelsR.swap(pixelsR);
+	std::vector<cl::Event> uploadedL, uploadedR;
+	auto inputL = uploadInputImage(m_context, m_uploadQueue, slot.pixelsL, width, height, uploadedL);
+	auto inputR = uploadInputImage(m_context, m_uploadQueue, slot.pixelsR, width, height, uploadedR);
+	slot.width = width;
+	slot.height = height;
+	m_uploadQueue.flush();
+
+	auto left = precalcImage(m_context, m_leftQueue, inputL, width, height, m_params, &uploadedL);
+	auto right = precalcImage(m_context, m_rightQueue, inputR, width, height, m_params, &uploadedR);
+	releaseImage(m_context, inputL, {left.ready});
+	releaseImage(m_context, inputR, {right.ready});
+	auto result = computeDisparity(m_context, m_leftQueue, m_rightQueue, left, right, m_params, &m_temporal);
+	slot.outWidth = result.width;
+	slot.outHeight = result.height;
+
+	// non-blocking readback, the callback marks the frame ready to pop
+	slot.disparity.resize(result.width * result.height);
+	cl::size_t<3> region;
+	region[0] = result.width;
+	region[1] = result.height;
+	region[2] = 1;
+	const std::vector<cl::Event> waitEvents{result.ready};
+	cl::Event readDone;
+	int clError = m_transferQueue.enqueueReadImage(result.image, CL_FALSE, cl::size_t<3>(), region, 0, 0, slot.disparity.data(), &waitEvents, &readDone);
+	Logger::logOpenClError(clError, "read back streamed frame");
+	error_quit_program(clError);
+	releaseImage(m_context, result.image, {readDone});
+	clError = readDone.setCallback(CL_COMPLETE, onReadBack, &slot);
+	Logger::logOpenClError(clError, "set readback callback");
+	error_quit_program(clError);
+	m_transferQueue.flush();
+}
+
+
+bool ClUtils::StreamEngine::popResult(std::vector<uint8_t>& disparity, unsigned& width, unsigned& height, bool& failed) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_inFlight == 0) {
+		return false;
+	}
+	Slot& slot = m_slots[m_tail];
+	m_changed.wait(lock, [&slot]() { return slot.readBack; });
+	failed = slot.failed;
+	if (!failed) {
+		slot.disparity.swap(disparity);
+	}
+	width = slot.outWidth;
+	height = slot.outHeight;
+	slot.busy = false;
+	m_tail = (m_tail + 1) % m_slots.size();
+	--m_inFlight;
+	m_changed.notify_all();
+	return true;
+}
+
+
+unsigned ClUtils::StreamEngine::framesInFlight() const {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_inFlight;
+}
+
+
+void CL_CALLBACK ClUtils::StreamEngine::onReadBack(cl_event, cl_int status, void* userData) {
+	auto slot = static_cast<Slot*>(userData);
+	// a negative status means the frame or one of the commands it waited for failed
+	Logger::logOpenClError(status, "stream frame");
+	std::lock_guard<std::mutex> lock(slot->owner->m_mutex);
+	slot->readBack = true;
+	slot->failed = status < 0;
+	slot->owner->m_changed.notify_all();
+}
+
@@ -1,16 +1,212 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include "BatchRunner.hpp"
 #include "ClUtils.hpp"
+#include "DeviceCaps.hpp"
+#include "ImagePool.hpp"
 #include "lodepng.h"
 #include "Logger.hpp"
+#include "MultiDevice.hpp"
+#include "ProgramCache.hpp"
+#include "StreamEngine.hpp"
 
 
-int main() {
+namespace {
+
+void printUsage(const char* program) {
+	std::cout << "usage: " << program << " [--device <cpu|gpu|accelerator|platform:device|name>] [--transfer <auto|copy|zero-copy>] [--downscale <factor >= 1>] [--window <size>] [--precalc <fused|separate|integral|separable|auto>] [--disparity <window|cost-volume|strip>] [--block <1|2|4>x<1|2>] [--storage <float|half>] [--benchmark-stats <repeats>] [--pyramid <levels>] [--multi-device]"
+		<< " [--batch <directory|manifest> [--output <directory>] [--frames-in-flight <n>] [--stream [--temporal <range>]]]" << std::endl
+		<< "  --batch <directory|manifest>  process many pairs instead of im0.png and im1.png: the subdirectories holding an\n"
+		<< "                                im0.png and an im1.png, or the lines 'left right [output]' of a manifest\n"
+		<< "  --output <directory>          write the maps of the batch there instead of next to the inputs\n"
+		<< "  --frames-in-flight <n>        the pairs of the batch in flight at the same time, 4 by default\n"
+		<< "  --stream                      process the pairs of the batch as the frames of a video, in order\n"
+		<< "  --temporal <range>            search only this many disparities either side of the previous frame's where it was\n"
+		<< "                                confident, 0 by default for the full range every frame" << std::endl;
+}
+
+}
+
+
+int main(int argc, char** argv) {
 	using namespace ClUtils;
 
-	// initialize OpenCL
-	int clError = 0;
-	auto clCtx = initCl();
-	cl::CommandQueue queue(clCtx, CL_QUEUE_PROFILING_ENABLE);
+	// parse command line
+	std::string deviceOverride, batchInput, outputDirectory;
+	unsigned framesInFlight = 4, temporalRange = 0, pyramidLevels = 0, benchmarkRepeats = 0;
+	DisparityParams baseParams;
+	bool multiDevice = false, stream = false;
+	// the numeric options throw on values which are not numbers
+	try {
+		for (int i = 1; i < argc; ++i) {
+			const std::string arg = argv[i];
+			if (arg == "--device" && i + 1 < argc) {
+				deviceOverride = argv[++i];
+			} else if (arg == "--transfer" && i + 1 < argc) {
+				const std::string mode = argv[++i];
+				if (mode != "auto" && mode != "copy" && mode != "zero-copy") {
+					printUsage(argv[0]);
+					return 1;
+				}
+				setTransferMode(mode == "copy" ? TransferMode::Copy : mode == "zero-copy" ? TransferMode::ZeroCopy : TransferMode::Auto);
+			} else if (arg == "--batch" && i + 1 < argc) {
+				batchInput = argv[++i];
+			} else if (arg == "--output" && i + 1 < argc) {
+				outputDirectory = argv[++i];
+			} else if (arg == "--frames-in-flight" && i + 1 < argc) {
+				framesInFlight = std::max(static_cast<unsigned>(std::stoul(argv[++i])), 1u);
+			} else if (arg == "--temporal" && i + 1 < argc) {
+				temporalRange = static_cast<unsigned>(std::stoul(argv[++i]));
+			} else if (arg == "--downscale" && i + 1 < argc) {
+				baseParams.downscale = std::stof(argv[++i]);
+				// the gray image cannot be larger than the input
+				if (!std::isfinite(baseParams.downscale) || baseParams.downscale < 1.f) {
+					printUsage(argv[0]);
+					return 1;
+				}
+			} else if (arg == "--window" && i + 1 < argc) {
+				// the window must have a center pixel
+				baseParams.window = static_cast<unsigned>(std::stoul(argv[++i])) | 1u;
+			} else if (arg == "--precalc" && i + 1 < argc) {
+				const std::string engine = argv[++i];
+				if (engine != "fused" && engine != "separate" && engine != "integral" && engine != "separable" && engine != "auto") {
+					printUsage(argv[0]);
+					return 1;
+				}
+				baseParams.precalcEngine = engine == "separate" ? PrecalcEngine::Separate : engine == "integral" ? PrecalcEngine::Integral
+					: engine == "separable" ? PrecalcEngine::Separable : engine == "auto" ? PrecalcEngine::Auto : PrecalcEngine::Fused;
+			} else if (arg == "--disparity" && i + 1 < argc) {
+				const std::string engine = argv[++i];
+				if (engine != "window" && engine != "cost-volume" && engine != "strip") {
+					printUsage(argv[0]);
+					return 1;
+				}
+				baseParams.disparityEngine = engine == "cost-volume" ? DisparityEngine::CostVolume
+					: engine == "strip" ? DisparityEngine::Strip : DisparityEngine::Window;
+			} else if (arg == "--block" && i + 1 < argc) {
+				// <columns>x<rows>, e.g. 2x2
+				const std::string block = argv[++i];
+				const size_t separator = block.find('x');
+				baseParams.blockWidth = static_cast<unsigned>(std::stoul(block.substr(0, separator)));
+				baseParams.blockHeight = separator == std::string::npos ? 1 : static_cast<unsigned>(std::stoul(block.substr(separator + 1)));
+				const auto supported = [](unsigned size, unsigned largest) { return size == 1 || size == 2 || size == largest; };
+				if (!supported(baseParams.blockWidth, 4) || !supported(baseParams.blockHeight, 2)) {
+					printUsage(argv[0]);
+					return 1;
+				}
+			} else if (arg == "--storage" && i + 1 < argc) {
+				const std::string storage = argv[++i];
+				if (storage != "float" && storage != "half") {
+					printUsage(argv[0]);
+					return 1;
+				}
+				baseParams.storage = storage == "half" ? StoragePrecision::Half : StoragePrecision::Float;
+			} else if (arg == "--benchmark-stats" && i + 1 < argc) {
+				benchmarkRepeats = static_cast<unsigned>(std::stoul(argv[++i]));
+			} else if (arg == "--pyramid" && i + 1 < argc) {
+				pyramidLevels = static_cast<unsigned>(std::stoul(argv[++i]));
+			} else if (arg == "--stream") {
+				stream = true;
+			} else if (arg == "--multi-device") {
+				multiDevice = true;
+			} else {
+				printUsage(argv[0]);
+				return 1;
+			}
+		}
+	} catch (const std::logic_error&) {
+		printUsage(argv[0]);
+		return 1;
+	}
+	// the stream mode only applies to a batch, the temporal search to a stream
+	if ((stream && batchInput.empty()) || (temporalRange > 0 && !stream)) {
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	if (!batchInput.empty()) {
+		// pairs which cannot be found count as failed, an unattended batch must not stop
+		unsigned unreadable = 0;
+		const auto pairs = std::filesystem::is_directory(batchInput) ? findPairs(batchInput, unreadable, outputDirectory)
+			: readPairManifest(batchInput, unreadable, outputDirectory);
+		auto clCtx = initCl(deviceOverride);
+		setKernelTimeLogging(false);
+		if (stream) {
+			// the pairs are frames of a video: decode and encode on this thread, device work in flight
+			auto params = baseParams.fitToDevice(deviceCaps(clCtx));
+			params.temporalRange = temporalRange;
+			StreamEngine engine(clCtx, params, framesInFlight);
+			std::vector<uint8_t> pixelsL, pixelsR, disparity;
+			// the outputs of the pushed frames, in push order
+			std::vector<const StereoPair*> pushed;
+			size_t saved = 0;
+			unsigned failed = unreadable;
+			const auto saveOldest = [&]() {
+				unsigned outWidth, outHeight;
+				bool frameFailed;
+				engine.popResult(disparity, outWidth, outHeight, frameFailed);
+				const auto& output = pushed[saved++]->output;
+				if (frameFailed) {
+					std::cout << "frame failed on the device, not saved: " << output << std::endl;
+					++failed;
+					return;
+				}
+				unsigned error = lodepng::encode(output, disparity, outWidth, outHeight, LCT_GREY, 8);
+				Logger::logSave(error, output.c_str());
+				if (error) {
+					++failed;
+				}
+			};
+			const auto start = std::chrono::steady_clock::now();
+			for (const auto& pair : pairs) {
+				unsigned width, height, widthR, heightR;
+				// the decoder appends to the vectors
+				pixelsL.clear();
+				pixelsR.clear();
+				unsigned error = lodepng::decode(pixelsL, width, height, pair.left, LCT_RGBA);
+				if (error) {
+					Logger::logLoad(error, pair.left.c_str());
+				} else if ((error = lodepng::decode(pixelsR, widthR, heightR, pair.right, LCT_RGBA))) {
+					Logger::logLoad(error, pair.right.c_str());
+				} else if (width != widthR || height != heightR) {
+					std::cout << "input image dimensions should match: " << pair.left << std::endl;
+					error = 1;
+				}
+				if (error) {
+					++failed;
+					continue;
+				}
+				if (engine.framesInFlight() == framesInFlight) {
+					saveOldest();
+				}
+				pushed.push_back(&pair);
+				engine.pushFrame(pixelsL, pixelsR, width, height);
+			}
+			while (engine.framesInFlight() > 0) {
+				saveOldest();
+			}
+			const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "stream: " << pairs.size() << " frames, " << failed << " failed, in " << seconds << "s, "
+				<< pushed.size() / seconds << " frames/s" << std::endl;
+			return failed == 0 ? 0 : 1;
+		}
+		auto params = baseParams.fitToDevice(deviceCaps(clCtx));
+		params.pyramidLevels = pyramidLevels;
+		BatchRunner runner(clCtx, params, framesInFlight);
+		const unsigned failed = runner.run(pairs) + unreadable;
+		runner.logStats();
+		if (unreadable > 0) {
+			std::cout << "batch: " << unreadable << " pairs could not be found" << std::endl;
+		}
+		ProgramCache::forContext(clCtx).logStats();
+		ImagePool::forContext(clCtx).logStats();
+		return failed == 0 ? 0 : 1;
+	}
 
 	// load images
 	unsigned widthL, heightL, widthR, heightR;
@@ -21,46 +217,49 @@ int main() {
 		error_quit_program(1);
 	}
 
-	// calculate image mean&stddev
-	auto imDataL = precalcImage(clCtx, queue, pixelsL, widthL, heightL);
-	auto imDataR = precalcImage(clCtx, queue, pixelsR, widthL, heightL);
+	if (multiDevice) {
+		// --device narrows the devices the bands are spread over
+		MultiDeviceExecutor executor(matchingDevices(deviceOverride), baseParams);
+		unsigned outWidth, outHeight;
+		auto processedImage = executor.computeDisparity(pixelsL, pixelsR, widthL, heightL, outWidth, outHeight);
+		logKernelTimes();
+		executor.logBalance();
+		unsigned error = lodepng::encode("out.png", processedImage, outWidth, outHeight, LCT_GREY, 8);
+		Logger::logSave(error, "out.png");
+		getchar();
+		return 0;
+	}
 
-	// calculate disparity maps + normalize
-	auto dispL = calculateDisparityMap(clCtx, queue, imDataL, imDataR, false);
-	auto dispR = calculateDisparityMap(clCtx, queue, imDataR, imDataL, true);
+	// initialize OpenCL
+	auto clCtx = initCl(deviceOverride);
+	auto leftQueue = createQueue(clCtx);
+	auto rightQueue = createQueue(clCtx);
+	baseParams.pyramidLevels = pyramidLevels;
+	auto params = baseParams.fitToDevice(deviceCaps(clCtx));
 
-	// cross-check
-	auto crossCheckImg = createGrayClImage(clCtx, imDataL.width, imDataL.height, CL_UNSIGNED_INT8);
-	{
-		auto crossCheckKernel = loadKernel(clCtx, "crossCheck.cl", "crossCheck");
-		crossCheckKernel.setArg(0, crossCheckImg);
-		crossCheckKernel.setArg(1, dispL);
-		crossCheckKernel.setArg(2, dispR);
-		runKernel(queue, crossCheckKernel, cl::NDRange(imDataL.width, imDataL.height), "cross check kernel");
+	if (benchmarkRepeats > 0) {
+		// the window statistics of the left image with every engine
+		setKernelTimeLogging(false);
+		benchmarkWindowStatistics(clCtx, leftQueue, pixelsL, widthL, heightL, params, benchmarkRepeats);
+		return 0;
 	}
 
-	// postprocess (occlusion fill)
-	auto outImg = createGrayClImage(clCtx, imDataL.width, imDataL.height, CL_UNSIGNED_INT8);
-	{
-		auto occlusionKernel = loadKernel(clCtx, "occlusionFill.cl", "occlusionFill");
-		occlusionKernel.setArg(0, outImg);
-		occlusionKernel.setArg(1, crossCheckImg);
-		runKernel(queue, occlusionKernel, cl::NDRange(imDataL.width, imDataL.height), "occlusionFill kernel");
+	if (params.storage == StoragePrecision::Half) {
+		setKernelTimeLogging(false);
+		logPrecisionDifference(clCtx, leftQueue, rightQueue, pixelsL, pixelsR, widthL, heightL, baseParams);
+		setKernelTimeLogging(true);
 	}
 
-	// save output image
-	std::vector<uint8_t> processedImage(imDataL.width * imDataL.height);
-	cl::size_t<3> size;
-	size[0] = imDataL.width;
-	size[1] = imDataL.height;
-	size[2] = 1;
-	clError = queue.enqueueReadImage(outImg, CL_TRUE, cl::size_t<3>(), size, 0, 0, processedImage.data());
-	Logger::logOpenClError(clError, "read computed image");
-	error_quit_program(clError);
-    queue.finish();
+	// precalc, disparity maps, cross-check and occlusion fill
+	auto result = computeDisparity(clCtx, leftQueue, rightQueue, pixelsL, pixelsR, widthL, heightL, params);
 
-	unsigned error = lodepng::encode("out.png", processedImage, imDataL.width, imDataL.height, LCT_GREY, 8);
-	Logger::logSave(error, "out.png");
+	// save output image
+	const std::vector<cl::Event> waitEvents{result.ready};
+	saveGrayImage(leftQueue, result.image, result.width, result.height, "out.png", &waitEvents);
+	releaseImage(clCtx, result.image, {});
+	logKernelTimes();
+	ProgramCache::forContext(clCtx).logStats();
+	ImagePool::forContext(clCtx).logStats();
 	getchar();
     return 0;
-}
\ No newline at end of file
+}